@@ -1,9 +1,12 @@
 #!/usr/bin/env python
 import subprocess
+import contextlib
+import difflib
 import json
 import glob
 import hashlib
 import os
+import re
 import sys
 import time
 import shutil
@@ -11,6 +14,7 @@ import shutil
 os.chdir(sys.path[0])
 
 EVAL_PATH = '.eval.json'
+EVAL_NCL_PATH = 'tests/eval.ncl'
 BUILD_DIR = 'build'
 SUBCOMMAND = sys.argv[1]
 HASH_MANAGED = '!managed'
@@ -28,7 +32,7 @@ def compute_hash_sig():
 
 def save_evaluation():
     completed_proc = subprocess.run(
-        ['nickel', 'export', '-Incl', 'tests/eval.ncl'],
+        ['nickel', 'export', '-Incl', EVAL_NCL_PATH],
         capture_output=True,
         text=True,
     )
@@ -96,11 +100,268 @@ def meson_configure():
     return result
 
 
+# Sets a boolean meson option for the duration of one command, so later compiles go back to the normal firmware
+@contextlib.contextmanager
+def meson_option(key):
+    subprocess.run(['meson', 'configure', f'-D{key}=true'], check=True, cwd=BUILD_DIR)
+    try:
+        yield
+    finally:
+        subprocess.run(['meson', 'configure', f'-D{key}=false'], check=True, cwd=BUILD_DIR)
+
+
 def subcmd_compile():
     meson_configure()
     subprocess.run(['meson', 'compile'], check=True, cwd=BUILD_DIR)
 
 
+def subcmd_sim():
+    meson_configure()
+
+    with meson_option('sim'):
+        subprocess.run(['meson', 'compile', 'sim'], check=True, cwd=BUILD_DIR)
+
+        if len(sys.argv) > 2 and sys.argv[2] not in ['--check', '--update']:
+            completed_proc = subprocess.run([os.path.join(BUILD_DIR, 'sim')] + sys.argv[2:])
+            sys.exit(completed_proc.returncode)
+
+        # Replay every script in tests/<eval>.sim/ and compare with its recorded trace
+        update = len(sys.argv) > 2 and sys.argv[2] == '--update'
+        stem = os.path.splitext(os.path.basename(EVAL_NCL_PATH))[0]
+        scripts = sorted(glob.glob(os.path.join('tests', stem + '.sim', '*.txt')))
+        failed = []
+
+        for script in scripts:
+            trace = os.path.splitext(script)[0] + '.out'
+            completed_proc = subprocess.run(
+                [os.path.join(BUILD_DIR, 'sim'), script],
+                capture_output=True,
+                text=True,
+            )
+
+            if completed_proc.returncode != 0:
+                print(completed_proc.stderr, end='')
+                failed.append(script)
+                continue
+
+            if update:
+                with open(trace, 'w') as f:
+                    f.write(completed_proc.stdout)
+                print('Wrote %s' % trace)
+                continue
+
+            expected = None
+            if os.path.isfile(trace):
+                with open(trace, 'r') as f:
+                    expected = f.read()
+
+            if completed_proc.stdout != expected:
+                failed.append(script)
+                print('FAIL %s' % script)
+                sys.stdout.writelines(difflib.unified_diff(
+                    (expected or '').splitlines(True),
+                    completed_proc.stdout.splitlines(True),
+                    trace,
+                    script,
+                ))
+            else:
+                print('ok   %s' % script)
+
+        if failed:
+            print('%d of %d scripts failed' % (len(failed), len(scripts)))
+            sys.exit(1)
+
+
+# Functions whose cycles are broken down per keyboard_scan() iteration
+BENCH_FUNCTIONS = [
+    'keyboard_scan_user',
+    'split_periph_scan',
+    'combo_handle',
+    'handle_key_events',
+    'USB_EP1I_send_now',
+]
+
+# Functions that wait on hardware ucsim doesn't model (touch-key timer, USB host)
+# These return immediately so only their call count is meaningful
+BENCH_STUBS = [
+    'delay',
+    'USB_EP2I_write_now',
+    'USB_EP3I_send_now',
+]
+
+
+def load_cdb_functions(path):
+    # Linker records: L:G$name$0_0$0:ADDR (start) and L:XG$name$0_0$0:ADDR (end)
+    # Static functions use F<module>$ instead of G$
+    record = re.compile(r'^L:(X?)(?:G|F[^$]*)\$([^$]+)\$[^:]*:([0-9A-Fa-f]+)$')
+    starts = {}
+    ends = {}
+
+    with open(path, 'r') as f:
+        for line in f:
+            m = record.match(line.strip())
+            if m is None:
+                continue
+            (ends if m.group(1) else starts)[m.group(2)] = int(m.group(3), 16)
+
+    return {name: (starts[name], ends[name]) for name in ends if name in starts}
+
+
+def ihx_data_size(path):
+    # Sum of the byte counts of all data records (type 00)
+    size = 0
+
+    with open(path, 'r') as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith(':') and line[7:9] == '00':
+                size += int(line[1:3], 16)
+
+    return size
+
+
+class Ucsim:
+    def __init__(self, ihx_path):
+        s51 = shutil.which('s51') or shutil.which('ucsim_51')
+
+        if s51 is None:
+            sys.exit('Error: ucsim (s51) not found! It ships with sdcc. Aborting.')
+
+        self.proc = subprocess.Popen(
+            [s51, '-t', '8052', '-X', '24M', ihx_path],
+            stdin=subprocess.PIPE,
+            stdout=subprocess.PIPE,
+            stderr=subprocess.STDOUT,
+            text=True,
+            bufsize=0,
+        )
+        self.read_until_prompt()
+
+    def read_until_prompt(self):
+        out = ''
+        while not out.endswith('> '):
+            c = self.proc.stdout.read(1)
+            if c == '':
+                sys.exit('Error: ucsim exited unexpectedly.\n' + out)
+            out += c
+        return out
+
+    def cmd(self, command):
+        self.proc.stdin.write(command + '\n')
+        return self.read_until_prompt()
+
+    def state(self):
+        out = self.cmd('state')
+        pc = int(re.search(r'PC= *0x([0-9A-Fa-f]+)', out).group(1), 16)
+        clks = int(re.search(r'\((\d+) clks\)', out).group(1))
+        return pc, clks
+
+    def close(self):
+        self.proc.stdin.write('quit\n')
+        self.proc.wait()
+
+
+def subcmd_bench():
+    args = sys.argv[2:]
+    check = '--check' in args
+    args = [arg for arg in args if arg != '--check']
+    iterations = int(args[0]) if args else 100
+
+    meson_configure()
+
+    with meson_option('bench'):
+        subprocess.run(['meson', 'compile', 'central.ihx'], check=True, cwd=BUILD_DIR)
+
+        functions = load_cdb_functions(os.path.join(BUILD_DIR, 'central.cdb'))
+        scan_start = functions['keyboard_scan'][0]
+        measured = [name for name in BENCH_FUNCTIONS if name in functions]
+        stubs = [name for name in BENCH_STUBS if name in functions]
+
+        entries = {functions[name][0]: name for name in measured}
+        exits = {functions[name][1]: name for name in measured}
+        stub_entries = {functions[name][0]: name for name in stubs}
+
+        calls = {name: 0 for name in measured + stubs}
+        totals = {name: 0 for name in measured}
+        open_calls = []
+
+        sim = Ucsim(os.path.join(BUILD_DIR, 'central.ihx'))
+
+        for addr in set([scan_start] + list(entries) + list(exits) + list(stub_entries)):
+            sim.cmd('break 0x%x' % addr)
+
+        scan_count = -1 # The first entry only marks the start
+        scan_first_clks = 0
+        scan_last_clks = 0
+
+        while scan_count < iterations:
+            sim.cmd('go')
+            pc, clks = sim.state()
+
+            if pc == scan_start:
+                if scan_count < 0:
+                    scan_first_clks = clks
+                scan_last_clks = clks
+                scan_count += 1
+
+                # Only count calls made within the measured iterations
+                if scan_count == 0:
+                    calls = {name: 0 for name in calls}
+                    totals = {name: 0 for name in totals}
+            if pc in entries and scan_count >= 0:
+                name = entries[pc]
+                calls[name] += 1
+                open_calls.append((name, clks))
+            if pc in stub_entries:
+                name = stub_entries[pc]
+                if name not in entries and scan_count >= 0:
+                    calls[name] += 1
+                # Jump straight to the function's final ret
+                sim.cmd('pc 0x%x' % functions[name][1])
+                pc, clks = sim.state()
+            if pc in exits and open_calls and open_calls[-1][0] == exits[pc]:
+                name, start_clks = open_calls.pop()
+                totals[name] += clks - start_clks
+
+        sim.close()
+        flash_bytes = ihx_data_size(os.path.join(BUILD_DIR, 'central.ihx'))
+
+    stem = os.path.splitext(os.path.basename(EVAL_NCL_PATH))[0]
+    out_path = os.path.join('tests', stem + '.bench.tsv')
+
+    scan_total = scan_last_clks - scan_first_clks
+    lines = [
+        '# iterations\t%d\n' % iterations,
+        '# flash_bytes\t%d\n' % flash_bytes,
+        'function\tcalls\tclks_total\tclks_per_scan\n',
+        'keyboard_scan\t%d\t%d\t%d\n' % (iterations, scan_total, scan_total // iterations),
+    ]
+
+    for name in measured + [n for n in stubs if n not in measured]:
+        total = totals.get(name, 0)
+        lines.append('%s\t%d\t%d\t%d\n' % (name, calls[name], total, total // iterations))
+
+    if check:
+        # ucsim is cycle-exact, so any difference from the committed table is a real change
+        if not os.path.isfile(out_path):
+            sys.exit('Error: %s is missing. Run the bench without --check and commit it.' % out_path)
+
+        with open(out_path, 'r') as f:
+            expected = f.readlines()
+
+        if expected != lines:
+            sys.stdout.writelines(difflib.unified_diff(expected, lines, out_path, 'bench'))
+            sys.exit(1)
+
+        print('ok   %s' % out_path)
+        return
+
+    with open(out_path, 'w') as f:
+        f.writelines(lines)
+
+    print('Wrote %s' % out_path)
+
+
 def wait_for_device():
     if shutil.which('wchisp') is None:
         sys.exit('Error: wchisp not found! Aborting.')
@@ -167,6 +428,10 @@ elif SUBCOMMAND in ['flash', 'flash_c', 'flash_central']:
     subcmd_flash_central()
 elif SUBCOMMAND in ['flash_p', 'flash_peripheral']:
     subcmd_flash_peripheral()
+elif SUBCOMMAND == 'bench':
+    subcmd_bench()
+elif SUBCOMMAND == 'sim':
+    subcmd_sim()
 elif SUBCOMMAND == 'load_managed_eval':
     subcmd_load_managed_eval()
 elif SUBCOMMAND == 'clean':
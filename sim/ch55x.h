@@ -0,0 +1,44 @@
+// Host stand-in for src/inc/ch55x.h
+// Lets the central firmware sources compile with a regular C compiler so the
+// scan loop can be driven by sim.c instead of real pins and a real USB host.
+
+#ifndef __CH55X_H__
+#define __CH55X_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+// SDCC memory space qualifiers and keywords
+#define __xdata
+#define __idata
+#define __data
+#define __code
+#define __at(addr)
+#define __bit _Bool
+#define __interrupt(n)
+
+// Generated pin definitions become plain variables.
+// The generated keyboard_scan_user() that reads them is never called in the sim.
+#define SBIT(name, addr, bit) static volatile uint8_t name
+#define SFR(name, addr) static volatile uint8_t name
+
+// Ports the generated scan code reads whole
+static volatile uint8_t P0, P1, P2, P3;
+
+// The peripheral link is not simulated.
+// Scripts address peripheral keys by their central key index like any other key.
+#undef SPLIT_ENABLE
+#undef SPLIT_SOFT_SERIAL_PIN
+
+// Virtual time has no frames to sync to
+#undef USB_SOF_SYNC_ENABLE
+
+extern volatile uint8_t EA;
+extern volatile uint8_t ET0;
+extern volatile uint8_t ES;
+extern volatile uint8_t IE_USB;
+
+extern volatile uint16_t timer_1ms;
+extern uint8_t EP1I_buffer[];
+
+#endif // __CH55X_H__
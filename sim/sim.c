@@ -0,0 +1,169 @@
+// Host-native simulation of the central side
+//
+// Replays a script of key transitions through keyboard_scan() in virtual time and prints
+// every HID report the virtual host receives, along with the event-to-report latency.
+//
+// Script format, one transition per line ('#' starts a comment):
+//   <time_ms> <key_idx> <1 = down | 0 = up>
+//
+// Output format, tab-separated:
+//   <time_ms> <latency_ms since the last transition> <endpoint> <report bytes...>
+
+#include "ch55x.h"
+#include "sim.h"
+#include "keyboard.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SIM_MAX_TRANSITIONS 4096
+
+typedef struct {
+    uint32_t time_ms;
+    uint8_t key_idx;
+    uint8_t down;
+} sim_transition_t;
+
+static sim_transition_t transitions[SIM_MAX_TRANSITIONS];
+static uint16_t transition_count = 0;
+
+static uint8_t key_down[KEY_COUNT];
+static uint8_t key_touched[KEY_COUNT];
+
+static uint8_t has_last_transition = 0;
+static uint32_t last_transition_ms = 0;
+
+static uint32_t report_count = 0;
+static uint32_t max_latency_ms = 0;
+
+// Only keys mentioned by the script are informed, so virtual keys are left to the firmware.
+// They read as released from the start until their first transition.
+void keyboard_init_user() {}
+
+void keyboard_scan_user() {
+    for (uint8_t i = 0; i < KEY_COUNT; i++) {
+        if (key_touched[i]) key_state_inform(i, key_down[i]);
+    }
+}
+
+void sim_report(const char *tag, const uint8_t *buf, uint8_t len) {
+    printf("%u\t", sim_now);
+
+    if (has_last_transition) {
+        uint32_t latency_ms = sim_now - last_transition_ms;
+        if (latency_ms > max_latency_ms) max_latency_ms = latency_ms;
+        printf("%u\t", latency_ms);
+    } else {
+        printf("-\t");
+    }
+
+    printf("%s", tag);
+
+    for (uint8_t i = 0; i < len; i++) {
+        printf(" %02X", buf[i]);
+    }
+
+    printf("\n");
+    report_count++;
+}
+
+void sim_note(const char *msg) {
+    printf("%u\t-\t# %s\n", sim_now, msg);
+}
+
+static void load_script(const char *path) {
+    FILE *f = fopen(path, "r");
+    char line[128];
+    uint16_t line_no = 0;
+
+    if (f == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned int time_ms, key_idx, down;
+        char *comment = strchr(line, '#');
+
+        line_no++;
+        if (comment) *comment = 0;
+        if (strspn(line, " \t\r\n") == strlen(line)) continue;
+
+        if (sscanf(line, "%u %u %u", &time_ms, &key_idx, &down) != 3 || key_idx >= KEY_COUNT || down > 1) {
+            fprintf(stderr, "%s:%u: Invalid transition\n", path, line_no);
+            exit(1);
+        }
+
+        if (transition_count && time_ms < transitions[transition_count - 1].time_ms) {
+            fprintf(stderr, "%s:%u: Transitions must be in chronological order\n", path, line_no);
+            exit(1);
+        }
+
+        if (transition_count == SIM_MAX_TRANSITIONS) {
+            fprintf(stderr, "%s:%u: Too many transitions\n", path, line_no);
+            exit(1);
+        }
+
+        sim_transition_t *t = &transitions[transition_count++];
+        t->time_ms = time_ms;
+        t->key_idx = key_idx;
+        t->down = down;
+        key_touched[key_idx] = 1;
+    }
+
+    fclose(f);
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "Usage: %s [-p scan_period_ms] [-t tail_ms] [-m max_latency_ms] script\n", argv0);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    uint16_t scan_period_ms = 1;
+    uint32_t tail_ms = 1000;
+    int32_t gate_latency_ms = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:t:m:")) != -1) {
+        switch (opt) {
+        case 'p': scan_period_ms = atoi(optarg); break;
+        case 't': tail_ms = atoi(optarg); break;
+        case 'm': gate_latency_ms = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 1 || scan_period_ms == 0) usage(argv[0]);
+
+    load_script(argv[optind]);
+
+    uint32_t end_ms = tail_ms + (transition_count ? transitions[transition_count - 1].time_ms : 0);
+    uint16_t next = 0;
+
+    keyboard_init();
+
+    while (sim_now <= end_ms) {
+        for (; next < transition_count && transitions[next].time_ms <= sim_now; next++) {
+            sim_transition_t *t = &transitions[next];
+            key_down[t->key_idx] = t->down;
+            has_last_transition = 1;
+            last_transition_ms = t->time_ms;
+        }
+
+        keyboard_scan();
+        sim_advance(scan_period_ms);
+    }
+
+    printf("# reports %u\n", report_count);
+    printf("# max_latency_ms %u\n", max_latency_ms);
+
+    if (gate_latency_ms >= 0 && max_latency_ms > (uint32_t) gate_latency_ms) {
+        fprintf(stderr, "Max latency of %u ms exceeds %d ms\n", max_latency_ms, gate_latency_ms);
+        return 2;
+    }
+
+    return 0;
+}
@@ -0,0 +1,14 @@
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <stdint.h>
+
+// Virtual milliseconds since the start of the simulation. Unlike timer_1ms, this doesn't wrap.
+extern uint32_t sim_now;
+
+void sim_advance(uint16_t ms);
+void sim_usb_poll();
+void sim_report(const char *tag, const uint8_t *buf, uint8_t len);
+void sim_note(const char *msg);
+
+#endif // __SIM_H__
@@ -0,0 +1,185 @@
+// Host stand-ins for time.c, usb.c and bootloader.c
+// The virtual USB host polls each endpoint every USB_EPn_INTERVAL virtual milliseconds (bInterval).
+
+#include "ch55x.h"
+#include "sim.h"
+#include "time.h"
+#include "usb.h"
+#include "bootloader.h"
+
+#include <string.h>
+
+volatile uint8_t EA;
+volatile uint8_t ET0;
+volatile uint8_t ES;
+volatile uint8_t IE_USB;
+
+volatile uint16_t timer_1ms;
+uint32_t sim_now;
+
+uint8_t EP1I_buffer[USB_EP1_SIZE];
+static uint8_t EP1I_sent[USB_EP1_SIZE];
+static uint8_t EP1I_report[USB_EP1_SIZE];
+static uint8_t EP1I_fifo[USB_EP1I_FIFO_LEN][USB_EP1_SIZE];
+static uint8_t EP1I_fifo_head;
+static uint8_t EP1I_fifo_size;
+static __bit EP1I_busy;
+static __bit EP1I_tail_open;
+
+#ifdef NKRO_ENABLE
+// The virtual host never asks for the boot protocol
+__bit hid_protocol_keyboard = 1;
+#endif
+
+#ifdef CONSUMER_KEYS_ENABLE
+static uint16_t EP2I_buffer[USB_EP2_SIZE / 2];
+#endif
+
+#ifdef MOUSE_KEYS_ENABLE
+static uint8_t EP3I_buffer[USB_EP3_SIZE];
+static __bit EP3I_armed;
+#endif
+
+void sim_advance(uint16_t ms) {
+    while (ms--) {
+        sim_now++;
+        timer_1ms++;
+        sim_usb_poll();
+    }
+}
+
+void sim_usb_poll() {
+    if (EP1I_busy && sim_now % USB_EP1_INTERVAL == 0) {
+        if (memcmp(EP1I_sent, EP1I_buffer, USB_EP1_SIZE)) {
+            memcpy(EP1I_sent, EP1I_buffer, USB_EP1_SIZE);
+            sim_report("kb", EP1I_buffer, USB_EP1_SIZE);
+        }
+
+        // USB_EP1_IN()
+        if (EP1I_fifo_size) {
+            memcpy(EP1I_buffer, EP1I_fifo[EP1I_fifo_head], USB_EP1_SIZE);
+            EP1I_fifo_head = (EP1I_fifo_head + 1) & (USB_EP1I_FIFO_LEN - 1);
+            EP1I_fifo_size--;
+        } else {
+            EP1I_busy = 0;
+            EP1I_tail_open = 0;
+        }
+    }
+
+#ifdef MOUSE_KEYS_ENABLE
+    if (EP3I_armed && sim_now % USB_EP3_INTERVAL == 0) {
+        EP3I_armed = 0;
+        sim_report("ms", EP3I_buffer, USB_EP3_SIZE);
+    }
+#endif
+}
+
+// time.c
+
+void delay(uint16_t ms) {
+    sim_advance(ms);
+}
+
+uint16_t get_timer() {
+    return timer_1ms;
+}
+
+uint16_t get_timer_ticks() {
+    return timer_1ms * TIMER0_TICKS_PER_MS;
+}
+
+// usb.c
+
+uint8_t USB_EP1I_read(uint8_t idx) {
+    return EP1I_report[idx];
+}
+
+void USB_EP1I_write(uint8_t idx, uint8_t value) {
+    EP1I_report[idx] = value;
+    USB_EP1I_ready_send();
+}
+
+// Same queueing as usb.c, with the host poll standing in for the EP1 IN interrupt
+void USB_EP1I_ready_send() {
+    if (EP1I_tail_open && EP1I_fifo_size) {
+        memcpy(EP1I_fifo[(EP1I_fifo_head + EP1I_fifo_size - 1) & (USB_EP1I_FIFO_LEN - 1)], EP1I_report, USB_EP1_SIZE);
+    } else if (EP1I_tail_open && EP1I_busy) {
+        memcpy(EP1I_buffer, EP1I_report, USB_EP1_SIZE);
+    } else if (!EP1I_busy) {
+        memcpy(EP1I_buffer, EP1I_report, USB_EP1_SIZE);
+        EP1I_busy = 1;
+    } else {
+        while (EP1I_fifo_size == USB_EP1I_FIFO_LEN) {
+            sim_advance(1);
+        }
+
+        memcpy(EP1I_fifo[(EP1I_fifo_head + EP1I_fifo_size) & (USB_EP1I_FIFO_LEN - 1)], EP1I_report, USB_EP1_SIZE);
+        EP1I_fifo_size++;
+    }
+
+    EP1I_tail_open = 1;
+}
+
+void USB_EP1I_send_now() {
+    USB_EP1I_ready_send();
+    EP1I_tail_open = 0;
+}
+
+uint8_t USB_EP1I_free_slots() {
+    return EP1I_busy ? USB_EP1I_FIFO_LEN - EP1I_fifo_size : USB_EP1I_FIFO_LEN + 1;
+}
+
+#ifdef CONSUMER_KEYS_ENABLE
+void USB_EP2I_write_now(uint8_t idx, uint16_t value) {
+    EP2I_buffer[idx] = value;
+
+    do {
+        sim_advance(1);
+    } while (sim_now % USB_EP2_INTERVAL);
+
+    sim_report("cs", (uint8_t *) EP2I_buffer, USB_EP2_SIZE);
+}
+#endif
+
+#ifdef MOUSE_KEYS_ENABLE
+uint8_t USB_EP3I_read(uint8_t idx) {
+    return EP3I_buffer[idx];
+}
+
+void USB_EP3I_write(uint8_t idx, uint8_t value) {
+    EP3I_buffer[idx] = value;
+    USB_EP3I_ready_send();
+}
+
+void USB_EP3I_ready_send() {
+    EP3I_armed = 1;
+}
+
+void USB_EP3I_send_now() {
+    USB_EP3I_ready_send();
+
+    while (EP3I_armed) {
+        sim_advance(1);
+    }
+}
+#endif
+
+// bootloader.c
+
+void bootloader() {
+    sim_note("bootloader");
+}
+
+void sw_reset() {
+    sim_note("sw_reset");
+}
+
+#ifdef NEOPIXEL_ENABLE
+#include "keymap.h"
+
+void neopixel_on_layer_state_change(const fak_layer_state_t state) {
+    state;
+}
+
+void neopixel_process() {}
+#endif
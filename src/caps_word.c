@@ -3,20 +3,30 @@
 #include "ch55x.h"
 
 #include "time.h"
+#include "deadline.h"
 #include "split_central.h"
 
+// Turns itself off after this long without a key
+#define CAPS_WORD_IDLE_MS 5000
+
 __bit caps_word_state = 0;
 
 void caps_word_on() {
     caps_word_state = 1;
+    deadline_set(DEADLINE_CAPS_WORD, get_timer() + CAPS_WORD_IDLE_MS);
 }
 
 void caps_word_off() {
     caps_word_state = 0;
+    deadline_clear(DEADLINE_CAPS_WORD);
 }
 
 void caps_word_toggle() {
-    caps_word_state = !caps_word_state;
+    if (caps_word_state) {
+        caps_word_off();
+    } else {
+        caps_word_on();
+    }
 }
 
 __bit caps_word_active() {
@@ -28,11 +38,7 @@ __bit caps_word_handle_key(uint8_t code, uint8_t shift_pressed) {
     return 0;
   }
 
-  // check hasn't timed out
-  if ((get_timer() - get_last_tap_timestamp()) > 5000) {
-    caps_word_state = 0;
-    return 0;
-  }
+  deadline_set(DEADLINE_CAPS_WORD, get_timer() + CAPS_WORD_IDLE_MS);
 
   // this assumes US layout on the host OS.
   if ((code >= 0x04) && code < (0x04 + 26)) {
@@ -45,7 +51,7 @@ __bit caps_word_handle_key(uint8_t code, uint8_t shift_pressed) {
   } else if (code == 0x4C) { // delete
   } else {
     // otherwise: not an accepted key; disable caps word
-    caps_word_state = 0;
+    caps_word_off();
   }
 
   return 0;
@@ -1,14 +1,25 @@
 #include "combo.h"
 #include "time.h"
+#include "deadline.h"
 #include "split_central.h"
 
 #define REF_COUNT_OWNED 255
 
 #define COMBO_KEY_COUNT(combo_def) ((combo_def.flags & COMBO_FLAGS_KEY_COUNT_MASK) + 2)
 
+#if COMBO_MAX_KEY_COUNT > 8
+typedef uint16_t fak_combo_key_mask_t;
+#else
+typedef uint8_t fak_combo_key_mask_t;
+#endif
+
 typedef struct {
     uint8_t state;
     uint16_t timestamp;
+    // Bit j is set if key_indices[j] is in the combo key queue
+    fak_combo_key_mask_t pressed_keys;
+    // Subset of pressed_keys, owned by an active combo
+    fak_combo_key_mask_t owned_keys;
 } fak_combo_state_t;
 
 typedef struct {
@@ -23,43 +34,91 @@ typedef struct {
 
 extern __code fak_combo_def_t combo_defs[COMBO_COUNT];
 
+// One bit per key index, set if the key is in any combo
+extern __code uint8_t combo_key_bitmap[];
+
+// Indices of the combos each key is in, combo_key_combos[combo_key_combos_start[key_idx]...]
+extern __code uint8_t combo_key_combos_start[KEY_COUNT + 1];
+extern __code uint8_t combo_key_combos[];
+
+#define BITMAP_GET(bitmap, i) (bitmap[(i) >> 3] & (1 << ((i) & 7)))
+
+#define COMBO_KEY_MASK_PRESSED 0x01
+#define COMBO_KEY_MASK_OWNED 0x02
+
 __xdata __at(XADDR_COMBO_STATES) fak_combo_state_t combo_states[COMBO_COUNT];
 __xdata __at(XADDR_COMBO_KEY_QUEUE) fak_combo_key_queue_t combo_key_queue;
 
+// Set when the queue or a combo state changes, so the next combo_handle() has work to do.
+// Otherwise, it only has to wake up for the earliest pending combo timeout.
+static __bit combo_dirty;
+
+// Updates the key masks of every combo the key is in
+static void combo_key_masks_update(uint8_t key_idx, uint8_t masks, uint8_t set) {
+    for (uint8_t i = combo_key_combos_start[key_idx]; i < combo_key_combos_start[key_idx + 1]; i++) {
+        uint8_t combo_idx = combo_key_combos[i];
+        fak_combo_state_t *cs = &combo_states[combo_idx];
+        fak_combo_key_mask_t bit = 1;
+
+        for (uint8_t j = 0; combo_defs[combo_idx].key_indices[j] != key_idx; j++) {
+            bit <<= 1;
+        }
+
+        if (set) {
+            if (masks & COMBO_KEY_MASK_PRESSED) cs->pressed_keys |= bit;
+            if (masks & COMBO_KEY_MASK_OWNED) cs->owned_keys |= bit;
+        } else {
+            if (masks & COMBO_KEY_MASK_PRESSED) cs->pressed_keys &= ~bit;
+            if (masks & COMBO_KEY_MASK_OWNED) cs->owned_keys &= ~bit;
+        }
+    }
+
+    combo_dirty = 1;
+}
+
+static void combo_key_queue_push(uint8_t key_idx) {
+    fak_combo_key_queue_entry_t e = { .key_idx = key_idx };
+    combo_key_queue.q[combo_key_queue.size++] = e;
+    combo_key_masks_update(key_idx, COMBO_KEY_MASK_PRESSED, 1);
+}
+
 static void combo_key_queue_remove(uint8_t idx) {
+    combo_key_masks_update(combo_key_queue.q[idx].key_idx, COMBO_KEY_MASK_PRESSED | COMBO_KEY_MASK_OWNED, 0);
+
     for (uint8_t i = idx; i < combo_key_queue.size - 1; i++) {
         combo_key_queue.q[i] = combo_key_queue.q[i + 1];
     }
     combo_key_queue.size--;
 }
 
-void combo_push_key_event(uint8_t key_idx, uint8_t pressed) {
-    if (pressed) {
+static uint8_t is_combo_key(uint8_t key_idx) {
+    if (!BITMAP_GET(combo_key_bitmap, key_idx))
+        return 0;
+
 #ifdef COMBO_REQUIRE_PRIOR_IDLE_MS_ENABLE
-        uint16_t last_tap_delta = get_timer() - get_last_tap_timestamp();
-#endif
+    uint16_t last_tap_delta = timer_elapsed(get_last_tap_timestamp());
 
-        // Add to combo key queue if key is in any (handle-able) combo
-        for (uint8_t i = COMBO_COUNT; i;) {
-            i--;
+    // The key only counts if at least one of its combos doesn't require more prior idle time
+    for (uint8_t i = combo_key_combos_start[key_idx]; i < combo_key_combos_start[key_idx + 1]; i++) {
+        uint16_t require_prior_idle_ms = combo_defs[combo_key_combos[i]].require_prior_idle_ms;
 
-#ifdef COMBO_REQUIRE_PRIOR_IDLE_MS_ENABLE
-            // Do not handle combo if it requires prior idle time
-            uint16_t require_prior_idle_ms = combo_defs[i].require_prior_idle_ms;
+        if (!require_prior_idle_ms || require_prior_idle_ms <= last_tap_delta) {
+            return 1;
+        }
+    }
 
-            if (require_prior_idle_ms && require_prior_idle_ms > last_tap_delta) {
-                continue;
-            }
+    return 0;
+#else
+    return 1;
 #endif
+}
 
-            for (uint8_t j = COMBO_KEY_COUNT(combo_defs[i]); j;) {
-                if (combo_defs[i].key_indices[--j] != key_idx)
-                    continue;
-
-                fak_combo_key_queue_entry_t e = { .key_idx = key_idx };
-                combo_key_queue.q[combo_key_queue.size++] = e;
-                return combo_handle();
-            }
+void combo_push_key_event(uint8_t key_idx, uint8_t pressed) {
+    if (pressed) {
+        // Add to combo key queue if key is in any (handle-able) combo
+        if (is_combo_key(key_idx)) {
+            combo_key_queue_push(key_idx);
+            return combo_handle();
         }
 
         // Otherwise, we have a non-combo key
@@ -112,6 +171,16 @@ void combo_push_key_event(uint8_t key_idx, uint8_t pressed) {
 }
 
 void combo_handle() {
+    uint16_t now = get_timer();
+
+    // Nothing changed since the last pass, which would come to the same conclusion
+    // unless a pending combo has just timed out
+    if (!combo_dirty && !deadline_due(DEADLINE_COMBO))
+        return;
+
+    combo_dirty = 0;
+    deadline_clear(DEADLINE_COMBO);
+
     // Reset ref counters except owned
     for (uint8_t i = combo_key_queue.size; i;) {
         uint8_t *ref_count = &combo_key_queue.q[--i].ref_count;
@@ -119,47 +188,41 @@ void combo_handle() {
     }
 
     for (uint8_t i = 0; i < COMBO_COUNT; i++) {
-        uint8_t pressed_keys = 0;
-        uint8_t combo_key_count = COMBO_KEY_COUNT(combo_defs[i]);
-
         #define combo_def (combo_defs[i])
         #define combo_state (combo_states[i])
-        #define all_pressed_keys ((1 << combo_key_count) - 1)
+        #define all_pressed_keys ((fak_combo_key_mask_t) ((1 << combo_key_count) - 1))
 
-        // Enumerate pressed keys
-        for (uint8_t j = 0; j < combo_key_count; j++) {
-            for (uint8_t k = 0; k < combo_key_queue.size; k++) {
-                if (combo_def.key_indices[j] != combo_key_queue.q[k].key_idx)
-                    continue;
-                
-                // Bail out if we see an owned key, which means this combo is impossible to trigger for now
-                // This only applies to inactive combos
-                if (combo_state.state != 2 && combo_key_queue.q[k].ref_count == REF_COUNT_OWNED) {
-                    combo_state.state = 0;
-                    goto exit_outer;
-                }
+        uint8_t combo_key_count = COMBO_KEY_COUNT(combo_def);
+        fak_combo_key_mask_t pressed_keys = combo_state.pressed_keys;
+        uint8_t prev_state = combo_state.state;
 
-                pressed_keys |= (1 << j);
-                break;
-            }
+        // A combo with an owned key is impossible to trigger for now
+        // This only applies to inactive combos
+        if (combo_state.state != 2 && combo_state.owned_keys) {
+            combo_state.state = 0;
+            goto exit_outer;
         }
 
         // Check for combo deprivation or timeout
         __bit will_own = 0;
 
         if (combo_state.state == 1) {
+            uint16_t elapsed = now - combo_state.timestamp;
+
             if (pressed_keys == 0) {
                 combo_state.state = 0;
-                continue;
-            } else if ((get_timer() - combo_state.timestamp) >= combo_def.timeout_ms) {
-                continue;
+                goto exit_outer;
+            } else if (elapsed >= combo_def.timeout_ms) {
+                goto exit_outer;
             } else if (pressed_keys == all_pressed_keys) {
                 will_own = 1;
+            } else {
+                deadline_set_earliest(DEADLINE_COMBO, combo_state.timestamp + combo_def.timeout_ms);
             }
         }
 
         // Populate ref counters, only if this is an inactive combo
-        if (combo_state.state != 2) {
+        if (combo_state.state != 2 && pressed_keys) {
             for (uint8_t j = 0; j < combo_key_count; j++) {
                 if (!(pressed_keys & (1 << j)))
                     continue;
@@ -170,6 +233,7 @@ void combo_handle() {
                     
                     if (will_own) {
                         combo_key_queue.q[k].ref_count = REF_COUNT_OWNED;
+                        combo_key_masks_update(combo_key_queue.q[k].key_idx, COMBO_KEY_MASK_OWNED, 1);
                     } else {
                         combo_key_queue.q[k].ref_count++;
                     }
@@ -181,7 +245,7 @@ void combo_handle() {
 
         if (combo_state.state == 0 && pressed_keys) {
             combo_state.state = 1;
-            combo_state.timestamp = get_timer();
+            combo_state.timestamp = now;
         } else if (combo_state.state == 1 && will_own) {
             combo_state.state = 2;
             push_key_event(combo_def.key_idx_mapping, 1);
@@ -200,6 +264,7 @@ void combo_handle() {
             }
         }
 exit_outer:
+        if (combo_state.state != prev_state) combo_dirty = 1;
     }
 
     // If no combo cares about a key anymore, press it then remove from queue
@@ -222,8 +287,13 @@ exit_outer:
 
 void combo_init() {
     for (uint8_t i = COMBO_COUNT; i;) {
-        combo_states[--i].state = 0;
+        fak_combo_state_t *cs = &combo_states[--i];
+        cs->state = 0;
+        cs->pressed_keys = 0;
+        cs->owned_keys = 0;
     }
 
     combo_key_queue.size = 0;
+    combo_dirty = 0;
+    deadline_clear(DEADLINE_COMBO);
 }
@@ -0,0 +1,21 @@
+#include "crc8.h"
+
+uint8_t crc8_update(uint8_t crc, uint8_t b) {
+    crc ^= b;
+
+    for (uint8_t i = 8; i; i--) {
+        crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    }
+
+    return crc;
+}
+
+uint8_t crc8(const uint8_t *buf, uint8_t len) {
+    uint8_t crc = 0;
+
+    while (len--) {
+        crc = crc8_update(crc, *buf++);
+    }
+
+    return crc;
+}
@@ -0,0 +1,10 @@
+#ifndef __CRC8_H__
+#define __CRC8_H__
+
+#include <stdint.h>
+
+// CRC-8 with polynomial 0x07 (x^8 + x^2 + x + 1), starting from 0
+uint8_t crc8_update(uint8_t crc, uint8_t b);
+uint8_t crc8(const uint8_t *buf, uint8_t len);
+
+#endif // __CRC8_H__
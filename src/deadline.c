@@ -0,0 +1,45 @@
+#include "deadline.h"
+#include "time.h"
+
+__xdata __at(XADDR_DEADLINES) fak_deadlines_t deadlines;
+
+// Deadlines compare wrap-safe, so they must be less than 32768 ms away when set.
+// A deadline that already passed is due on the next poll.
+void deadline_set(uint8_t id, uint16_t at) {
+    deadlines.at[id] = at;
+    deadlines.armed |= 1 << id;
+}
+
+// Same as deadline_set() unless an earlier deadline is already set
+void deadline_set_earliest(uint8_t id, uint16_t at) {
+    if ((deadlines.armed & (1 << id)) && (int16_t) (at - deadlines.at[id]) >= 0) return;
+    deadline_set(id, at);
+}
+
+void deadline_clear(uint8_t id) {
+    deadlines.armed &= ~(1 << id);
+    deadlines.due &= ~(1 << id);
+}
+
+uint8_t deadline_due(uint8_t id) {
+    return deadlines.due & (1 << id);
+}
+
+// Stays due on every poll until cleared or set again
+void deadlines_poll() {
+    uint16_t now = get_timer();
+    uint8_t due = 0;
+
+    for (uint8_t i = 0; i < DEADLINE_COUNT; i++) {
+        if ((deadlines.armed & (1 << i)) && (int16_t) (now - deadlines.at[i]) >= 0) {
+            due |= 1 << i;
+        }
+    }
+
+    deadlines.due = due;
+}
+
+void deadlines_init() {
+    deadlines.armed = 0;
+    deadlines.due = 0;
+}
@@ -0,0 +1,29 @@
+#ifndef __DEADLINE_H__
+#define __DEADLINE_H__
+
+#include <stdint.h>
+
+// Everything time-based on the central keeps its next deadline here instead of checking the clock
+// on every scan. keyboard_scan() polls them once at the start, then only the due ones do any work.
+#define DEADLINE_FUTURE_KEY   0 // Undecided hold-tap or tap-dance at the front of the key event queue
+#define DEADLINE_COMBO        1 // Earliest timeout of a partially pressed combo
+#define DEADLINE_MOUSE_SCROLL 2
+#define DEADLINE_CAPS_WORD    3 // Idle timeout
+#define DEADLINE_NEOPIXEL     4 // Latest time to send a changed LED buffer
+#define DEADLINE_COUNT        5
+
+typedef struct {
+    uint16_t at[DEADLINE_COUNT];
+    uint8_t armed;
+    uint8_t due; // As of the last deadlines_poll()
+} fak_deadlines_t;
+
+void deadline_set(uint8_t id, uint16_t at);
+void deadline_set_earliest(uint8_t id, uint16_t at);
+void deadline_clear(uint8_t id);
+uint8_t deadline_due(uint8_t id);
+
+void deadlines_poll();
+void deadlines_init();
+
+#endif // __DEADLINE_H__
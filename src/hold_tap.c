@@ -2,6 +2,7 @@
 #include "time.h"
 #include "usb.h"
 #include "key_event_queue.h"
+#include "deadline.h"
 
 #define STATE_DEFAULT 0
 #define STATE_PRE_QUICK_TAP 1
@@ -78,7 +79,7 @@ static uint8_t resolve_eager(uint8_t decide_hold, fak_key_state_t *ks, uint8_t b
     return HANDLE_RESULT_MAPPED;
 }
 
-uint8_t hold_tap_handle_event(fak_key_state_t *ks, uint8_t handle_event, int16_t delta) {
+uint8_t hold_tap_handle_event(fak_key_state_t *ks, uint8_t handle_event, uint16_t delta) {
     fak_key_event_t *ev_front = key_event_queue_front();
     uint8_t behavior_idx = (ks->key_code & KEY_CODE_HOLD_BEHAVIOR_MASK) >> 29;
     __code fak_hold_tap_behavior_t *behavior = &hold_tap_behaviors[behavior_idx];
@@ -111,7 +112,7 @@ uint8_t hold_tap_handle_event(fak_key_state_t *ks, uint8_t handle_event, int16_t
 #ifdef HOLD_TAP_GLOBAL_QUICK_TAP_ENABLE
         if (
             behavior->global_quick_tap_ms &&
-            (get_timer() - get_last_tap_timestamp()) < behavior->global_quick_tap_ms
+            timer_elapsed(get_last_tap_timestamp()) < behavior->global_quick_tap_ms
         ) {
 #ifdef HOLD_TAP_GLOBAL_QUICK_TAP_IGNORE_CONSECUTIVE_ENABLE
             if (behavior->flags & HOLD_TAP_FLAGS_GLOBAL_QUICK_TAP_IGNORE_CONSECUTIVE) {
@@ -135,7 +136,7 @@ uint8_t hold_tap_handle_event(fak_key_state_t *ks, uint8_t handle_event, int16_t
         switch (*state) {
         case STATE_DEFAULT:
             if (same_key_idx) {
-                if (!ev_in->pressed) {
+                if (!KEY_EVENT_PRESSED(ev_in)) {
 #ifdef HOLD_TAP_QUICK_TAP_ENABLE
                     // Process quick-tap if nothing was queued during tap-hold decision
                     if (behavior->quick_tap_ms && key_event_queue_get_size() == 1) {
@@ -159,7 +160,7 @@ uint8_t hold_tap_handle_event(fak_key_state_t *ks, uint8_t handle_event, int16_t
 
                 if (
                     (key_interrupt & HOLD_TAP_KEY_INTERRUPT_ENABLE)
-                    && ev_in->pressed == ((key_interrupt & 4) >> 2)
+                    && KEY_EVENT_PRESSED(ev_in) == ((key_interrupt & 4) >> 2)
                 ) {
                     uint8_t decide_hold = key_interrupt & HOLD_TAP_KEY_INTERRUPT_DECIDE_HOLD;
                     return resolve_eager(decide_hold, ks, behavior->flags);
@@ -180,7 +181,7 @@ uint8_t hold_tap_handle_event(fak_key_state_t *ks, uint8_t handle_event, int16_t
                 TEMP_TAP(ks, 0);
                 ks->key_code &= KEY_CODE_TAP_MASK;
                 return HANDLE_RESULT_MAPPED | HANDLE_RESULT_CONSUMED_EVENT;
-            } else if (ev_in->pressed) {
+            } else if (KEY_EVENT_PRESSED(ev_in)) {
                 TEMP_TAP(ks, 0);
                 return HANDLE_RESULT_COMPLETED;
             }
@@ -200,7 +201,7 @@ uint8_t hold_tap_handle_event(fak_key_state_t *ks, uint8_t handle_event, int16_t
 
             if (
                 (key_interrupt & HOLD_TAP_KEY_INTERRUPT_ENABLE)
-                && ev_in->pressed == ((key_interrupt & 4) >> 2)
+                && KEY_EVENT_PRESSED(ev_in) == ((key_interrupt & 4) >> 2)
             ) {
                 if (key_interrupt & HOLD_TAP_KEY_INTERRUPT_DECIDE_HOLD) {
                     ks->key_code &= KEY_CODE_HOLD_LAYER_IDX_MODS_MASK;
@@ -237,3 +238,33 @@ uint8_t hold_tap_handle_event(fak_key_state_t *ks, uint8_t handle_event, int16_t
 
     return 0;
 }
+
+// Pre-scan handling waits for this, the moment an undecided hold-tap would decide on its own
+void hold_tap_update_deadline(fak_key_state_t *ks) {
+    uint8_t behavior_idx = (ks->key_code & KEY_CODE_HOLD_BEHAVIOR_MASK) >> 29;
+    __code fak_hold_tap_behavior_t *behavior = &hold_tap_behaviors[behavior_idx];
+    uint16_t timeout_ms = 0;
+
+    switch (*key_event_queue_state()) {
+    case STATE_DEFAULT:
+        timeout_ms = behavior->timeout_ms;
+        break;
+#ifdef HOLD_TAP_QUICK_TAP_ENABLE
+    case STATE_PRE_QUICK_TAP:
+        timeout_ms = behavior->quick_tap_ms;
+        break;
+#ifdef HOLD_TAP_QUICK_TAP_INTERRUPT_ENABLE
+    case STATE_POST_QUICK_TAP:
+        timeout_ms = behavior->quick_tap_interrupt_ms;
+        break;
+#endif
+#endif
+    }
+
+    if (timeout_ms) {
+        deadline_set(DEADLINE_FUTURE_KEY, key_event_queue_front()->timestamp + timeout_ms);
+    } else {
+        // Only another key event can decide it
+        deadline_clear(DEADLINE_FUTURE_KEY);
+    }
+}
@@ -29,7 +29,8 @@
 
 uint8_t is_future_type_hold_tap(uint32_t key_code);
 
-uint8_t hold_tap_handle_event(fak_key_state_t *ks, uint8_t handle_ev, int16_t delta);
+uint8_t hold_tap_handle_event(fak_key_state_t *ks, uint8_t handle_ev, uint16_t delta);
+void hold_tap_update_deadline(fak_key_state_t *ks);
 
 typedef struct {
     uint8_t flags;
@@ -1,8 +1,17 @@
 #include "key_event_queue.h"
 #include "keymap.h"
 
+#if (KEY_EVENT_QUEUE_LEN & (KEY_EVENT_QUEUE_LEN - 1)) != 0
+#error "KEY_EVENT_QUEUE_LEN must be a power of two"
+#endif
+
+#define KEY_EVENT_QUEUE_MASK (KEY_EVENT_QUEUE_LEN - 1)
+#define Q_AT(i) (key_event_queue.q[(key_event_queue.head + (i)) & KEY_EVENT_QUEUE_MASK])
+
+// Ring buffer. The first `size` events from `head` are committed, the next `bsize` are buffered.
 typedef struct {
     fak_key_event_t q[KEY_EVENT_QUEUE_LEN];
+    uint8_t head;
     uint8_t size;
     uint8_t bsize;
     uint8_t state;
@@ -18,16 +27,20 @@ inline uint8_t key_event_queue_get_bsize() {
     return key_event_queue.bsize;
 }
 
+inline uint8_t key_event_queue_get_free() {
+    return KEY_EVENT_QUEUE_LEN - key_event_queue.size - key_event_queue.bsize;
+}
+
 inline uint8_t* key_event_queue_state() {
     return &key_event_queue.state;
 }
 
 inline fak_key_event_t* key_event_queue_front() {
-    return &key_event_queue.q[0];
+    return &Q_AT(0);
 }
 
 inline fak_key_event_t* key_event_queue_bfront() {
-    return &key_event_queue.q[key_event_queue.size];
+    return &Q_AT(key_event_queue.size);
 }
 
 void key_event_queue_push() {
@@ -39,25 +52,29 @@ void key_event_queue_push() {
 void key_event_queue_pop() {
     if (!key_event_queue.size) return;
 
-    for (uint8_t i = 0; i < (key_event_queue.size + key_event_queue.bsize - 1); i++) {
-        key_event_queue.q[i] = key_event_queue.q[i + 1];
-    }
-
+    key_event_queue.head = (key_event_queue.head + 1) & KEY_EVENT_QUEUE_MASK;
     key_event_queue.bsize += key_event_queue.size - 1;
     key_event_queue.size = 0;
 }
 
 void key_event_queue_bpush(fak_key_event_t *ev) {
-    key_event_queue.q[key_event_queue.size + key_event_queue.bsize] = *ev;
+    uint8_t len = key_event_queue.size + key_event_queue.bsize;
+    if (len == KEY_EVENT_QUEUE_LEN) return;
+
+    Q_AT(len) = *ev;
     key_event_queue.bsize++;
 }
 
+// Slides the committed events (usually just the front) over the buffered front.
+// This moves the front, so pointers from key_event_queue_front() must be fetched again.
 void key_event_queue_bpop() {
     if (!key_event_queue.bsize) return;
 
-    for (uint8_t i = 0; i < key_event_queue.bsize - 1; i++) {
-        key_event_queue.q[key_event_queue.size + i] = key_event_queue.q[key_event_queue.size + i + 1];
+    for (uint8_t i = key_event_queue.size; i; i--) {
+        Q_AT(i) = Q_AT(i - 1);
     }
+
+    key_event_queue.head = (key_event_queue.head + 1) & KEY_EVENT_QUEUE_MASK;
     key_event_queue.bsize--;
 }
 
@@ -67,6 +84,7 @@ void key_event_queue_breset() {
 }
 
 void key_event_queue_init() {
+    key_event_queue.head = 0;
     key_event_queue.size = 0;
     key_event_queue.bsize = 0;
     key_event_queue.state = 0;
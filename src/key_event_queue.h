@@ -3,15 +3,21 @@
 
 #include <stdint.h>
 
+#define KEY_EVENT_FLAGS_PRESSED 0x01
+#define KEY_EVENT_FLAGS_MAPPED 0x02
+
+#define KEY_EVENT_PRESSED(ev) ((ev)->flags & KEY_EVENT_FLAGS_PRESSED)
+#define KEY_EVENT_MAPPED(ev) ((ev)->flags & KEY_EVENT_FLAGS_MAPPED)
+
 typedef struct {
-    uint8_t pressed;
-    uint8_t mapped; // TODO: Wasteful. Merge with pressed as bit flags
+    uint8_t flags;
     uint8_t key_idx;
     uint16_t timestamp;
 } fak_key_event_t;
 
 inline uint8_t key_event_queue_get_size();
 inline uint8_t key_event_queue_get_bsize();
+inline uint8_t key_event_queue_get_free();
 inline uint8_t* key_event_queue_state();
 inline fak_key_event_t* key_event_queue_front();
 inline fak_key_event_t* key_event_queue_bfront();
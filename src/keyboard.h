@@ -1,13 +1,38 @@
 #ifndef __KEYBOARD_H__
 #define __KEYBOARD_H__
 
+#include <stdint.h>
+
 #define ENC_READ(n) ((!ENC_A##n << 1) | !ENC_B##n)
 
+// One port read of the table-driven scan code
+typedef struct {
+    uint8_t out_port; // Port of the strobed output. Unused if out_mask is 0.
+    uint8_t out_mask;
+    uint8_t in_port;
+    uint8_t in_mask;
+    uint8_t key_start; // Index into matrix_read_keys of the key on the lowest bit of in_mask
+    uint8_t strobe; // Index into matrix_settle_loops, if the settle time is calibrated
+} fak_matrix_read_t;
+
 #ifdef SPLIT_ENABLE
 #define SPLIT_KEY_COUNT_BYTES (((SPLIT_PERIPH_KEY_COUNT - 1) / 8) + 1)
 #define SPLIT_ENCODER_COUNT_BYTES ((SPLIT_PERIPH_ENCODER_COUNT + 3) / 4)
 #define SPLIT_MSG_REQUEST_KEYS 128
 #define SPLIT_MSG_REQUEST_ENCODERS (128 + 32)
+// Framed responses end with a CRC-8 of all the bytes before it.
+// Answered with SPLIT_MSG_REQUEST_BURST, the event sequence number, then all of key_bits and encoder_bits in one go
+#define SPLIT_MSG_REQUEST_BURST (128 + 64)
+// Answered with SPLIT_MSG_REQUEST_CHANGES, the sequence number of the first event, the event count, then (idx, value) per event
+#define SPLIT_MSG_REQUEST_CHANGES (128 + 65)
+// Answered with the last framed response again, as the changes in it are already drained
+#define SPLIT_MSG_REQUEST_RESEND (128 + 66)
+// Soft serial calibration only. Followed by a bit loop count, which is echoed back before both sides switch to it.
+#define SPLIT_MSG_REQUEST_SET_RATE (128 + 67)
+#define SPLIT_STATE_LEN (SPLIT_KEY_COUNT_BYTES + SPLIT_ENCODER_COUNT_BYTES)
+#define SPLIT_BURST_LEN (3 + SPLIT_STATE_LEN)
+#define SPLIT_CHANGES_LEN(n) (4 + 2 * (n))
+#define SPLIT_RX_LEN (SPLIT_BURST_LEN > SPLIT_CHANGES_LEN(SPLIT_EVENT_QUEUE_LEN) ? SPLIT_BURST_LEN : SPLIT_CHANGES_LEN(SPLIT_EVENT_QUEUE_LEN))
 #endif
 
 #ifdef SPLIT_SIDE_CENTRAL
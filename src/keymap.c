@@ -4,6 +4,15 @@
 #if LAYER_COUNT > 1
 __xdata __at(XADDR_LAYER_STATE) fak_layer_state_t layer_state = 0;
 __xdata __at(XADDR_PERSISTENT_LAYER_STATE) fak_layer_state_t persistent_layer_state = 1;
+__xdata __at(XADDR_HIGHEST_LAYER_IDX) uint8_t highest_layer_idx = 0;
+
+#ifdef LAYER_TRANSPARENCY_ENABLE
+#define KEY_LAYER_UNRESOLVED 0xFF
+
+// Layer each key resolves to when neither its hold nor its tap is transparent there.
+// Only valid until the next layer state change.
+__xdata __at(XADDR_KEY_LAYER_CACHE) uint8_t key_layer_cache[KEY_COUNT];
+#endif
 #endif
 
 uint32_t get_real_key_code(uint8_t key_idx) {
@@ -14,9 +23,21 @@ uint32_t get_real_key_code(uint8_t key_idx) {
 #ifdef LAYER_TRANSPARENCY_ENABLE
 #define IS_HOLD_TRANS (hold == 0xFFFF)
 #define IS_TAP_TRANS (tap == 0xFFFF)
+#ifdef LAYER_TRANSPARENCY_TABLE_ENABLE
+// Skips the layers where the key is fully transparent
+#define NEXT_LAYER_IDX(layer_idx) (layer_fallthrough[layer_idx][key_idx])
+#else
+#define NEXT_LAYER_IDX(layer_idx) ((layer_idx) - 1)
+#endif
     uint16_t hold = 0xFFFF;
     uint16_t tap = 0xFFFF;
-    uint8_t layer_idx = LAYER_COUNT - 1;
+    uint8_t layer_idx = key_layer_cache[key_idx];
+
+    if (layer_idx != KEY_LAYER_UNRESOLVED) {
+        return key_map[layer_idx][key_idx];
+    }
+
+    layer_idx = highest_layer_idx;
 
     do {
         if (!is_layer_on(layer_idx))
@@ -30,15 +51,22 @@ uint32_t get_real_key_code(uint8_t key_idx) {
             return 0;
         }
 
+        // Fully resolved on a single layer. This is the only case worth caching.
+        if (IS_HOLD_TRANS && IS_TAP_TRANS
+            && (key_code >> 16) != 0xFFFF && (key_code & 0xFFFF) != 0xFFFF) {
+            key_layer_cache[key_idx] = layer_idx;
+            return key_code;
+        }
+
         if (IS_HOLD_TRANS) hold = key_code >> 16;
         if (IS_TAP_TRANS)  tap = key_code & 0xFFFF;
-    } while (layer_idx-- && (IS_HOLD_TRANS || IS_TAP_TRANS));
+    } while ((layer_idx = NEXT_LAYER_IDX(layer_idx)) != 0xFF && (IS_HOLD_TRANS || IS_TAP_TRANS));
 
     if (hold == 0xFFFF) hold = 0;
     if (tap == 0xFFFF)  tap = 0;
     return ((uint32_t) hold << 16) | tap;
 #else
-    return key_map[get_highest_layer_idx()][key_idx];
+    return key_map[highest_layer_idx][key_idx];
 #endif
 
 #endif
@@ -47,11 +75,7 @@ uint32_t get_real_key_code(uint8_t key_idx) {
 #if LAYER_COUNT > 1
 
 uint8_t get_highest_layer_idx() {
-    for (uint8_t layer_idx = LAYER_COUNT - 1; layer_idx; layer_idx--) {
-        if (is_layer_on(layer_idx))
-            return layer_idx;
-    }
-    return 0;
+    return highest_layer_idx;
 }
 
 uint8_t get_default_layer_idx() {
@@ -62,6 +86,23 @@ uint8_t get_default_layer_idx() {
     return 0;
 }
 
+static void update_layer_caches() {
+    highest_layer_idx = 0;
+
+    for (uint8_t layer_idx = LAYER_COUNT - 1; layer_idx; layer_idx--) {
+        if (is_layer_on(layer_idx)) {
+            highest_layer_idx = layer_idx;
+            break;
+        }
+    }
+
+#ifdef LAYER_TRANSPARENCY_ENABLE
+    for (uint8_t i = KEY_COUNT; i;) {
+        key_layer_cache[--i] = KEY_LAYER_UNRESOLVED;
+    }
+#endif
+}
+
 static void on_layer_state_change() {
 #if CONDITIONAL_LAYER_COUNT > 0
     for (uint8_t i = 0; i < CONDITIONAL_LAYER_COUNT; i++) {
@@ -75,6 +116,8 @@ static void on_layer_state_change() {
     }
 #endif
 
+    update_layer_caches();
+
     for (unsigned int i = 0; layer_hooks[i] != NULL; i++) {
         layer_hooks[i](layer_state);
     }
@@ -130,6 +173,12 @@ uint8_t is_layer_off(uint8_t layer_idx) {
     return ((layer_state | persistent_layer_state) & (1 << layer_idx)) == 0;
 }
 
+void keymap_init() {
+    layer_state = 0;
+    persistent_layer_state = 1;
+    update_layer_caches();
+}
+
 #ifdef TRANS_LAYER_EXIT_ENABLE
 uint8_t get_trans_layer_exit_source_idx(uint8_t key_idx, uint8_t hold) {
     uint32_t mask = hold ? KEY_CODE_HOLD_LAYER_IDX_MODS_MASK : KEY_CODE_TAP_MASK;
@@ -32,6 +32,10 @@ typedef uint32_t fak_layer_state_t;
 
 extern __code uint32_t key_map[LAYER_COUNT][KEY_COUNT];
 
+#ifdef LAYER_TRANSPARENCY_TABLE_ENABLE
+extern __code uint8_t layer_fallthrough[LAYER_COUNT][KEY_COUNT];
+#endif
+
 #if CONDITIONAL_LAYER_COUNT > 0
 typedef struct {
     uint8_t then_layer;
@@ -60,6 +64,8 @@ void persistent_layer_state_off(uint8_t layer_idx);
 uint8_t is_layer_on(uint8_t layer_idx);
 uint8_t is_layer_off(uint8_t layer_idx);
 
+void keymap_init();
+
 #ifdef TRANS_LAYER_EXIT_ENABLE
 uint8_t get_trans_layer_exit_source_idx(uint8_t key_idx, uint8_t hold);
 #endif
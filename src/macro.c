@@ -1,47 +1,157 @@
 #include "macro.h"
 #include "keyboard.h"
+#include "keymap.h"
 #include "time.h"
 #include "usb.h"
 
-// TODO: Macro processing should be non-blocking
+__xdata __at(XADDR_MACRO_STATE) fak_macro_state_t macro_state;
 
-void macro_handle_key(uint16_t step_idx, uint8_t down) {
+// Taps a chain of MACRO_INST_TAP_BULK steps and the MACRO_INST_TAP that ends it.
+// The keys are pressed in one report and released in the next, as many as fit in the report.
+// The rest of the chain is left for the next call.
+static void macro_tap_bulk() {
+    uint16_t first = macro_state.pc;
+    uint16_t i;
+    uint8_t inst;
+    uint32_t arg;
+#ifdef NKRO_ENABLE
+    uint8_t last_code = 0;
+#endif
+
+    do {
+        inst = macro_steps[macro_state.pc].inst;
+        arg = macro_step_args[macro_steps[macro_state.pc].arg_idx];
+        if (macro_state.pc != first && !key_report_has_room(arg)) break;
+#ifdef NKRO_ENABLE
+        // The host reads a bitmap report in usage order, so a report only keeps the macro's order
+        // while codes go up
+        if (hid_protocol_keyboard) {
+            if (macro_state.pc != first && (arg & KEY_CODE_TAP_CODE_MASK) <= last_code) break;
+            last_code = arg & KEY_CODE_TAP_CODE_MASK;
+        }
+#endif
+
+        handle_non_future(arg, 1);
+        macro_state.pc++;
+    } while (inst == MACRO_INST_TAP_BULK);
+
+    USB_EP1I_send_now();
+
+    for (i = first; i != macro_state.pc; i++) {
+        handle_non_future(macro_step_args[macro_steps[i].arg_idx], 0);
+    }
+
+    USB_EP1I_send_now();
+}
+
+static void macro_start(uint16_t step_idx, uint8_t flags) {
+    macro_state.start = step_idx;
+    macro_state.pc = step_idx;
+    macro_state.flags = MACRO_FLAG_RUNNING | flags;
+}
+
+// Runs steps until the macro ends, pauses for release, or has to wait.
+// It also stops when the keyboard report queue is too full to take the next step.
+static void macro_run() {
     fak_macro_step_t step;
     uint32_t arg;
 
     while (1) {
-        step = macro_steps[step_idx++];
+        step = macro_steps[macro_state.pc];
 
-        if (step.inst == MACRO_INST_HALT) return;
-
-        if (step.inst == MACRO_INST_PAUSE_FOR_RELEASE) {
-            if (down) {
-                return;
-            } else {
-                down = 1;
+        switch (step.inst) {
+        case MACRO_INST_HALT:
+            if (macro_state.flags & MACRO_FLAG_QUEUED) {
+                // Its key may have come up while it waited
+                macro_start(macro_state.queued, macro_state.flags & MACRO_FLAG_QUEUED_RELEASED ? MACRO_FLAG_RELEASED : 0);
                 continue;
             }
-        }
 
-        if (!down) continue;
+            macro_state.flags = 0;
+            return;
 
-        arg = macro_step_args[step.arg_idx];
+        case MACRO_INST_PAUSE_FOR_RELEASE:
+            if (!(macro_state.flags & MACRO_FLAG_RELEASED)) {
+                macro_state.flags |= MACRO_FLAG_PAUSED;
+                return;
+            }
+            break;
 
-        switch (step.inst) {
         case MACRO_INST_PRESS:
-            handle_non_future(arg, 1);
-            USB_EP1I_send_now();
-            break;
         case MACRO_INST_RELEASE:
-            handle_non_future(arg, 0);
-            USB_EP1I_send_now();
-            break;
         case MACRO_INST_TAP:
-            tap_non_future(arg);
+            if (USB_EP1I_free_slots() < (step.inst == MACRO_INST_TAP ? 2 : 1)) return;
+
+            arg = macro_step_args[step.arg_idx];
+
+            if (step.inst == MACRO_INST_TAP) {
+                tap_non_future(arg);
+            } else {
+                handle_non_future(arg, step.inst == MACRO_INST_PRESS);
+                USB_EP1I_send_now();
+            }
             break;
+
+        case MACRO_INST_TAP_BULK:
+            if (USB_EP1I_free_slots() < 2) return;
+            macro_tap_bulk();
+            continue;
+
         case MACRO_INST_WAIT:
-            delay(arg);
-            break;
+            arg = macro_step_args[step.arg_idx];
+            macro_state.pc++;
+            macro_state.wait_start = get_timer();
+            macro_state.wait_ms = arg;
+            macro_state.flags |= MACRO_FLAG_WAITING;
+            return;
+        }
+
+        macro_state.pc++;
+    }
+}
+
+void macro_handle_key(uint16_t step_idx, uint8_t down) {
+    uint8_t flags = macro_state.flags;
+
+    if (down) {
+        // Only one macro runs at a time. The next one starts once this one is done, including
+        // the steps after its pause that wait for its own key to come up. Any more are dropped.
+        if (flags & MACRO_FLAG_RUNNING) {
+            if (!(flags & MACRO_FLAG_QUEUED)) {
+                macro_state.queued = step_idx;
+                macro_state.flags = flags | MACRO_FLAG_QUEUED;
+            }
+            return;
+        }
+
+        macro_start(step_idx, 0);
+        macro_run();
+    } else if ((flags & MACRO_FLAG_RUNNING) && macro_state.start == step_idx && !(flags & MACRO_FLAG_RELEASED)) {
+        macro_state.flags |= MACRO_FLAG_RELEASED;
+
+        if (flags & MACRO_FLAG_PAUSED) {
+            macro_state.flags &= ~MACRO_FLAG_PAUSED;
+            macro_state.pc++;
+            macro_run();
         }
+    } else if ((flags & MACRO_FLAG_QUEUED) && macro_state.queued == step_idx) {
+        macro_state.flags |= MACRO_FLAG_QUEUED_RELEASED;
+    }
+}
+
+void macro_process() {
+    if (!(macro_state.flags & MACRO_FLAG_RUNNING)) return;
+
+    if (macro_state.flags & MACRO_FLAG_WAITING) {
+        if (timer_elapsed(macro_state.wait_start) < macro_state.wait_ms) return;
+        macro_state.flags &= ~MACRO_FLAG_WAITING;
+    } else if (macro_state.flags & MACRO_FLAG_PAUSED) {
+        return;
     }
+
+    macro_run();
+}
+
+void macro_init() {
+    macro_state.flags = 0;
 }
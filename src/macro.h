@@ -9,6 +9,7 @@
 #define MACRO_INST_TAP                3
 #define MACRO_INST_WAIT               4
 #define MACRO_INST_PAUSE_FOR_RELEASE  5
+#define MACRO_INST_TAP_BULK           6 // A tap that shares its press and release reports with the next step
 
 typedef struct {
     uint8_t inst;
@@ -19,7 +20,26 @@ typedef struct {
 #endif
 } fak_macro_step_t;
 
+#define MACRO_FLAG_RUNNING  0x01
+#define MACRO_FLAG_WAITING  0x02
+#define MACRO_FLAG_PAUSED   0x04 // At MACRO_INST_PAUSE_FOR_RELEASE
+#define MACRO_FLAG_RELEASED 0x08
+#define MACRO_FLAG_QUEUED   0x10 // Another macro key was pressed while this one ran
+#define MACRO_FLAG_QUEUED_RELEASED 0x20
+
+// The running macro, advanced from keyboard_scan()
+typedef struct {
+    uint16_t start; // Step index the macro was started from, which identifies its key
+    uint16_t pc;
+    uint16_t queued; // Start of the macro to run next, with MACRO_FLAG_QUEUED
+    uint16_t wait_start;
+    uint16_t wait_ms;
+    uint8_t flags;
+} fak_macro_state_t;
+
+void macro_init();
 void macro_handle_key(uint16_t custom_code, uint8_t down);
+void macro_process();
 
 extern __code fak_macro_step_t macro_steps[];
 extern __code uint32_t macro_step_args[];
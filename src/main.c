@@ -17,12 +17,10 @@ void TMR0_ISR() __interrupt(INT_NO_TMR0) {
 }
 
 #if defined(SPLIT_ENABLE) && !defined(SPLIT_SOFT_SERIAL_PIN)
-#ifdef SPLIT_SIDE_PERIPHERAL
 void UART0_interrupt();
 void UART0_ISR() __interrupt(INT_NO_UART0) {
     UART0_interrupt();
 }
-#endif
 
 static void UART0_init() {
     // UART0 @ Timer1, 750k bps
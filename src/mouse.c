@@ -1,9 +1,9 @@
 #include "mouse.h"
 #include "usb.h"
 #include "time.h"
+#include "deadline.h"
 
 __xdata __at(XADDR_MOUSE_SCROLL_DIRECTION) int8_t scroll_direction = 0;
-__xdata __at(XADDR_MOUSE_SCROLL_AT_TIME) uint16_t scroll_at_time = 0;
 
 void mouse_handle_key(uint16_t custom_code, uint8_t down) {
     if (custom_code < 8) {
@@ -20,18 +20,23 @@ void mouse_handle_key(uint16_t custom_code, uint8_t down) {
     case 12: // Wheel up
     case 13: // Wheel down
         scroll_direction = custom_code == 12 ? down : -down;
-        scroll_at_time = get_timer();
+
+        if (down) {
+            deadline_set(DEADLINE_MOUSE_SCROLL, get_timer());
+        } else {
+            deadline_clear(DEADLINE_MOUSE_SCROLL);
+        }
         break;
     }
 }
 
 void mouse_process() {
     if (scroll_direction != 0) {
-        if (get_timer() >= scroll_at_time) {
+        if (deadline_due(DEADLINE_MOUSE_SCROLL)) {
             USB_EP3I_write(3, scroll_direction);
             USB_EP3I_send_now();
             USB_EP3I_write(3, 0);
-            scroll_at_time = get_timer() + MOUSE_SCROLL_INTERVAL_MS;
+            deadline_set(DEADLINE_MOUSE_SCROLL, get_timer() + MOUSE_SCROLL_INTERVAL_MS);
         }
     } else {
         USB_EP3I_write(3, 0);
@@ -6,6 +6,9 @@
 
 #include "neopixel.h"
 #include "keymap.h"
+#include "usb.h"
+#include "time.h"
+#include "deadline.h"
 #include <string.h>
 
 
@@ -13,6 +16,16 @@
 
 extern __code uint32_t led_map[LAYER_COUNT][LED_COUNT];
 __xdata __at(XADDR_LED_BUFFER) uint8_t led_buffer[3 * LED_COUNT];
+static __bit led_buffer_dirty = 0;
+
+// How long a changed buffer may wait for EP1 to go idle. The host may not be polling at all
+// while suspended or before it configures the device.
+#define NEOPIXEL_MAX_WAIT_MS 50
+
+static void led_buffer_changed() {
+  led_buffer_dirty = 1;
+  deadline_set_earliest(DEADLINE_NEOPIXEL, get_timer() + NEOPIXEL_MAX_WAIT_MS);
+}
 
 // ===================================================================================
 // Protocol Delays
@@ -113,7 +126,7 @@ void neopixel_show_layer(const uint32_t *colormap, const size_t len) {
     led_buffer[i * 3 + 2] = (colormap[i] >> 16) & 0xFF;
     #endif
   }
-  neopixel_update(led_buffer, sizeof(led_buffer));
+  led_buffer_changed();
 }
 
 void neopixel_on_layer_state_change(const fak_layer_state_t state) {
@@ -141,5 +154,22 @@ void neopixel_on_layer_state_change(const fak_layer_state_t state) {
       }
     }
   }
+  led_buffer_changed();
+}
+
+// ===================================================================================
+// Send the Buffer When It Changed
+// ===================================================================================
+// Called from the scan loop, so layer hooks only fill the buffer and never block.
+// The pixels latch on any pause in the data, so the buffer can't be split up and
+// goes out in one go with interrupts disabled. It waits until the host has taken
+// every queued keyboard report, which keeps that window off pending reports, but no
+// longer than NEOPIXEL_MAX_WAIT_MS in case the host stopped polling.
+void neopixel_process() {
+  if (!led_buffer_dirty) return;
+  if (USB_EP1I_free_slots() <= USB_EP1I_FIFO_LEN && !deadline_due(DEADLINE_NEOPIXEL)) return; // EP1 still busy
+
+  led_buffer_dirty = 0;
+  deadline_clear(DEADLINE_NEOPIXEL);
   neopixel_update(led_buffer, sizeof(led_buffer));
 }
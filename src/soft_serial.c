@@ -3,12 +3,26 @@
 
 #define SSP SPLIT_SOFT_SERIAL_PIN
 
+// Delay loop counts, read with direct addressing so they cost the same as an immediate
+__data uint8_t soft_serial_bit_loops;
+__data uint8_t soft_serial_start_loops;
+
 void soft_serial_init() {
+    soft_serial_set_bit_loops(SOFT_SERIAL_DEFAULT_BIT_LOOPS);
+
     __asm
         setb SPLIT_SOFT_SERIAL_PIN
     __endasm;
 }
 
+void soft_serial_set_bit_loops(uint8_t loops) {
+    uint8_t start_loops = SOFT_SERIAL_BIT_CYCLES(loops) / 16;
+
+    soft_serial_bit_loops = loops;
+    // Together with 4 fixed cycles, puts the samples about a quarter bit into each bit
+    soft_serial_start_loops = start_loops ? start_loops : 1;
+}
+
 void soft_serial_recv() {
     soft_serial_did_not_respond = 1;
     __asm
@@ -22,42 +36,44 @@ void soft_serial_recv() {
         mov r1, #0          ; 2 cyc nop
         // cpl 0xB2         ; for testing only
         mov r1, #0
-        mov r1, #0
-        mov r1, #0
+        mov r1, _soft_serial_start_loops
+    00003$:
+        djnz r1, 00003$     ; 4 cyc per loop with the mov
     00002$:
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
+        mov r1, _soft_serial_bit_loops
+    00004$:
+        djnz r1, 00004$
+#if SOFT_SERIAL_EXTRA_CYCLES > 0
+        nop
+#endif
+#if SOFT_SERIAL_EXTRA_CYCLES > 1
+        nop
+#endif
+#if SOFT_SERIAL_EXTRA_CYCLES > 2
+        nop
+#endif
         mov c, SSP          ; 2 cyc
         // cpl 0xB2         ; for testing only
         rrc a               ; 1 cyc
         djnz r0, 00002$     ; if jump 4 else 2 cyc
     
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-
+        mov r1, _soft_serial_bit_loops
+    00005$:
+        djnz r1, 00005$
+#if SOFT_SERIAL_EXTRA_CYCLES > 0
+        nop
+#endif
+#if SOFT_SERIAL_EXTRA_CYCLES > 1
+        nop
+#endif
+#if SOFT_SERIAL_EXTRA_CYCLES > 2
+        nop
+#endif
         nop                 ; add some delay before confirming stop bit
+        nop
+        nop
+        nop
+        nop
         jnb SSP, 00099$     ; fail if stop bit not detected
         // cpl 0xB2         ; for testing only
 
@@ -81,36 +97,51 @@ void soft_serial_send() {
         mov r1, #0
         nop
     00001$:
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
+        mov r1, _soft_serial_bit_loops
+    00002$:
+        djnz r1, 00002$ ; 4 cyc per loop with the mov
+#if SOFT_SERIAL_EXTRA_CYCLES > 0
+        nop
+#endif
+#if SOFT_SERIAL_EXTRA_CYCLES > 1
+        nop
+#endif
+#if SOFT_SERIAL_EXTRA_CYCLES > 2
+        nop
+#endif
         rrc a           ; 1 cyc
         mov SSP, c      ; 2 cyc
         djnz r0, 00001$ ; if jump 4 else 2 cyc
     
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
-        mov r1, #0
+        mov r1, _soft_serial_bit_loops
+    00003$:
+        djnz r1, 00003$
+#if SOFT_SERIAL_EXTRA_CYCLES > 0
+        nop
+#endif
+#if SOFT_SERIAL_EXTRA_CYCLES > 1
+        nop
+#endif
+#if SOFT_SERIAL_EXTRA_CYCLES > 2
+        nop
+#endif
+        nop
+        nop
+        nop
+        nop
         setb SSP        ; 2 cyc
     __endasm;
 }
+
+// Idles the line for about 4 bit times between bytes of a burst, so that the receiver
+// is back to polling for the start bit before the next byte begins
+void soft_serial_gap() {
+    __asm
+        mov r0, #4
+    00001$:
+        mov r1, _soft_serial_bit_loops
+    00002$:
+        djnz r1, 00002$
+        djnz r0, 00001$
+    __endasm;
+}
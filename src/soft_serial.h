@@ -3,12 +3,23 @@
 
 #include <stdint.h>
 
+// Each bit takes 7 cycles of shifting and looping, plus a 4-cycle delay loop and up to 3 nops
+#define SOFT_SERIAL_EXTRA_CYCLES ((SPLIT_SOFT_SERIAL_BIT_CYCLES - 7) % 4)
+#define SOFT_SERIAL_DEFAULT_BIT_LOOPS ((SPLIT_SOFT_SERIAL_BIT_CYCLES - 7) / 4)
+#define SOFT_SERIAL_BIT_CYCLES(loops) (4 * (loops) + 7 + SOFT_SERIAL_EXTRA_CYCLES)
+
+#if SOFT_SERIAL_DEFAULT_BIT_LOOPS < 1
+#error "Soft serial bit rate is too high for this clock"
+#endif
+
 __xdata __at(0x3FC) uint8_t soft_serial_sbuf;
 __xdata __at(0x3FD) uint8_t soft_serial_did_not_respond;
 
 void soft_serial_init();
+void soft_serial_set_bit_loops(uint8_t loops);
 
 void soft_serial_recv();
 void soft_serial_send();
+void soft_serial_gap();
 
 #endif // __SOFT_SERIAL_H__
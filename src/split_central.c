@@ -4,6 +4,10 @@
 #include "time.h"
 #include "keymap.h"
 #include "bootloader.h"
+#include "deadline.h"
+#ifdef SPLIT_ENABLE
+#include "crc8.h"
+#endif
 
 #ifdef HOLD_TAP_ENABLE
 #include "hold_tap.h"
@@ -29,12 +33,18 @@
 #ifdef SPLIT_SOFT_SERIAL_PIN
 #include "soft_serial.h"
 #endif
+#ifdef NEOPIXEL_ENABLE
+#include "neopixel.h"
+#endif
 
 __xdata __at(XADDR_LAST_TAP_TIMESTAMP) uint16_t last_tap_timestamp = 0;
 __xdata __at(XADDR_KEY_STATES) fak_key_state_t key_states[KEY_COUNT];
 
 __xdata __at(XADDR_STRONG_MODS_REF_COUNT) uint8_t strong_mods_ref_count[8];
 
+// Low byte of the timer, sampled once per scan
+static uint8_t debounce_timer;
+
 #ifdef STICKY_ENABLE
 __xdata __at(XADDR_PENDING_STICKY_MODS) uint8_t pending_sticky_mods = 0;
 __xdata __at(XADDR_APPLIED_STICKY_MODS) uint8_t applied_sticky_mods = 0;
@@ -135,14 +145,42 @@ static void write_weak_mods(uint8_t mods, uint8_t down) {
 }
 
 static void register_code(uint8_t key_code, uint8_t down) {
-    uint8_t key_check_ret = key_check(key_code);
-    uint8_t match_idx = key_check_ret & 0x0F;
-    uint8_t empty_idx = (key_check_ret & 0xF0) >> 4;
+    uint8_t idx;
+    uint8_t value;
 
-    __bit write = (down && !match_idx && empty_idx) || (!down && match_idx);
+#ifdef NKRO_ENABLE
+    if (hid_protocol_keyboard) {
+        uint8_t bit = 1 << (key_code & 7);
+        idx = 1 + (key_code >> 3);
 
-    if (!write) {
-        return;
+        // Out of the bitmap's usage range
+        if (idx >= USB_EP1_SIZE) {
+            return;
+        }
+
+        value = USB_EP1I_read(idx);
+
+        // Already in the requested state
+        if (!down == !(value & bit)) {
+            return;
+        }
+
+        value ^= bit;
+    } else
+#endif
+    {
+        uint8_t key_check_ret = key_check(key_code);
+        uint8_t match_idx = key_check_ret & 0x0F;
+        uint8_t empty_idx = (key_check_ret & 0xF0) >> 4;
+
+        __bit write = (down && !match_idx && empty_idx) || (!down && match_idx);
+
+        if (!write) {
+            return;
+        }
+
+        idx = down ? empty_idx : match_idx;
+        value = down ? key_code : 0;
     }
 
 #ifdef STICKY_ENABLE
@@ -163,10 +201,7 @@ static void register_code(uint8_t key_code, uint8_t down) {
     }
 #endif
 
-    USB_EP1I_write(
-        down ? empty_idx : match_idx,
-        down ? key_code  : 0
-    );
+    USB_EP1I_write(idx, value);
 
     last_tap_timestamp = get_timer();
 }
@@ -193,7 +228,7 @@ static void subhandle(uint8_t handle_event) {
     fak_key_state_t *ks = &key_states[ev_front->key_idx];
     uint8_t handle_result = HANDLE_RESULT_COMPLETED;
 
-    if (!ev_front->mapped && handle_event == HANDLE_EVENT_QUEUED && ev_front->pressed) {
+    if (!KEY_EVENT_MAPPED(ev_front) && handle_event == HANDLE_EVENT_QUEUED && KEY_EVENT_PRESSED(ev_front)) {
         ks->key_code = get_real_key_code(ev_front->key_idx);
 #ifdef STICKY_ENABLE
         if (applied_sticky_layer > 0) {
@@ -206,14 +241,14 @@ static void subhandle(uint8_t handle_event) {
     uint8_t future_type = get_future_type(ks->key_code);    
 
     if (future_type == FUTURE_TYPE_NONE) {
-        handle_non_future(ks->key_code, ev_front->pressed);
-        ks->status = (ks->status & ~KEY_STATUS_RESOLVED) | (ev_front->pressed << 2);
+        handle_non_future(ks->key_code, KEY_EVENT_PRESSED(ev_front));
+        ks->status = (ks->status & ~KEY_STATUS_RESOLVED) | (KEY_EVENT_PRESSED(ev_front) << 2);
         handle_result = HANDLE_RESULT_COMPLETED;
     } else {
-        int16_t delta = 0;
+        uint16_t delta = 0;
 
         if (handle_event == HANDLE_EVENT_PRE_SCAN) {
-            delta = get_timer() - ev_front->timestamp;
+            delta = timer_elapsed(ev_front->timestamp);
         } else if (handle_event == HANDLE_EVENT_INCOMING_EVENT) {
             delta = key_event_queue_bfront()->timestamp - ev_front->timestamp;
         }
@@ -254,14 +289,32 @@ static void subhandle(uint8_t handle_event) {
     if (handle_result & HANDLE_RESULT_COMPLETED) {
         key_event_queue_pop();
     } else if (handle_result & HANDLE_RESULT_MAPPED) {
-        ev_front->mapped = 1;
+        // Fetched again since key_event_queue_bpop() may have moved the front
+        key_event_queue_front()->flags |= KEY_EVENT_FLAGS_MAPPED;
         key_event_queue_breset();
     }
+
+    if (handle_result & (HANDLE_RESULT_COMPLETED | HANDLE_RESULT_MAPPED)) {
+        // Whatever is at the front now gets looked at on the next pre-scan
+        deadline_set(DEADLINE_FUTURE_KEY, get_timer());
+    } else switch (future_type) {
+#ifdef TAP_DANCE_ENABLE
+    case FUTURE_TYPE_TAP_DANCE:
+        tap_dance_update_deadline(ks);
+        break;
+#endif
+#ifdef HOLD_TAP_ENABLE
+    case FUTURE_TYPE_HOLD_TAP:
+        hold_tap_update_deadline(ks);
+        break;
+#endif
+    }
 }
 
 static void handle_key_events() {
     if (key_event_queue_get_bsize() == 0 && key_event_queue_get_size()) {
-        subhandle(HANDLE_EVENT_PRE_SCAN);
+        // Without new events, only a timeout can move the front along
+        if (deadline_due(DEADLINE_FUTURE_KEY)) subhandle(HANDLE_EVENT_PRE_SCAN);
         return;
     }
 
@@ -273,11 +326,36 @@ static void handle_key_events() {
             subhandle(HANDLE_EVENT_QUEUED);
         }
     }
+
+    if (!key_event_queue_get_size()) deadline_clear(DEADLINE_FUTURE_KEY);
 }
 
+// Keys whose press was queued and whose release hasn't been pushed yet. The key event queue always
+// keeps room for their releases, so a full queue can only drop presses and never leaves a key down.
+static uint8_t key_events_releases_reserved;
+
 void push_key_event(uint8_t key_idx, uint8_t pressed) {
     fak_key_state_t *ks = &key_states[key_idx];
 
+    if (pressed) {
+        // Room for this press, its release, and the releases of all other keys still down
+        if (key_event_queue_get_free() < key_events_releases_reserved + 2) {
+            ks->status |= KEY_STATUS_PRESS_DROPPED;
+            return;
+        }
+
+        if (!(ks->status & KEY_STATUS_PRESS_QUEUED)) {
+            ks->status |= KEY_STATUS_PRESS_QUEUED;
+            key_events_releases_reserved++;
+        }
+    } else if (ks->status & KEY_STATUS_PRESS_DROPPED) {
+        ks->status &= ~KEY_STATUS_PRESS_DROPPED;
+        return;
+    } else if (ks->status & KEY_STATUS_PRESS_QUEUED) {
+        ks->status &= ~KEY_STATUS_PRESS_QUEUED;
+        key_events_releases_reserved--;
+    }
+
     if (!pressed && (ks->status & KEY_STATUS_RESOLVED)) {
         handle_non_future(ks->key_code, 0);
         ks->status &= ~KEY_STATUS_RESOLVED;
@@ -286,8 +364,7 @@ void push_key_event(uint8_t key_idx, uint8_t pressed) {
     }
 
     fak_key_event_t key_ev = {
-        .pressed = pressed,
-        .mapped = 0,
+        .flags = pressed ? KEY_EVENT_FLAGS_PRESSED : 0,
         .key_idx = key_idx,
         .timestamp = get_timer()
     };
@@ -443,118 +520,497 @@ void tap_non_future(uint32_t key_code) {
     USB_EP1I_send_now();
 }
 
-void key_state_inform(uint8_t key_idx, uint8_t down) {
-    fak_key_state_t *ks = &key_states[key_idx];
-    uint8_t last_down = (ks->status & KEY_STATUS_DEBOUNCE) >> 1;
-    
-    if (last_down == down) {
-        uint8_t last_pressed = ks->status & KEY_STATUS_DOWN;
-        if (last_pressed == down) return;
+// Whether a plain key_code pressed now would take a free spot in the pending report.
+// Caps word and sticky mods change the report per key, so no keys are grouped while they are in play.
+uint8_t key_report_has_room(uint32_t key_code) {
+    uint8_t tap_code = key_code & KEY_CODE_TAP_CODE_MASK;
 
-        ks->status = ks->status & ~KEY_STATUS_DOWN | down;
+#ifdef CAPS_WORD_ENABLE
+    if (caps_word_active()) return 0;
+#endif
+#ifdef STICKY_ENABLE
+    if (pending_sticky_mods || applied_sticky_mods) return 0;
+#endif
+#ifdef NKRO_ENABLE
+    if (hid_protocol_keyboard) {
+        uint8_t idx = 1 + (tap_code >> 3);
+        return idx < USB_EP1_SIZE && !(USB_EP1I_read(idx) & (1 << (tap_code & 7)));
+    }
+#endif
+
+    uint8_t key_check_ret = key_check(tap_code);
+    return !(key_check_ret & 0x0F) && (key_check_ret & 0xF0);
+}
+
+static void key_state_register(uint8_t key_idx, uint8_t down) {
+    fak_key_state_t *ks = &key_states[key_idx];
+    ks->status = ks->status & ~KEY_STATUS_DOWN | down;
 #if COMBO_COUNT > 0
-        combo_push_key_event(key_idx, down);
+    combo_push_key_event(key_idx, down);
 #else
-        push_key_event(key_idx, down);
+    push_key_event(key_idx, down);
 #endif
-    } else {
-        ks->status = ks->status & ~KEY_STATUS_DEBOUNCE | (down << 1);
+}
+
+void key_state_inform(uint8_t key_idx, uint8_t down) {
+    fak_key_state_t *ks = &key_states[key_idx];
+    uint8_t status = ks->status;
+    uint8_t last_down = (status & KEY_STATUS_DEBOUNCE) >> 1;
+
+    if (last_down != down) {
+        // Raw edge. Restart the stability window.
+        ks->debounce_timestamp = debounce_timer;
+        ks->status = status & ~(KEY_STATUS_DEBOUNCE | KEY_STATUS_STABLE) | (down << 1);
+
+#if defined(DEBOUNCE_EAGER_PRESS_ENABLE) || defined(DEBOUNCE_EAGER_RELEASE_ENABLE)
+        // Eager edges register immediately, but only if the key was stable before them.
+        // Otherwise this is a bounce and the edge is deferred like any other.
+        if (!(status & KEY_STATUS_STABLE) || (status & KEY_STATUS_DOWN) == down)
+            return;
+#if !defined(DEBOUNCE_EAGER_RELEASE_ENABLE)
+        if (!down) return;
+#elif !defined(DEBOUNCE_EAGER_PRESS_ENABLE)
+        if (down) return;
+#endif
+        key_state_register(key_idx, down);
+#endif
+        return;
+    }
+
+    if (!(status & KEY_STATUS_STABLE)) {
+        if ((uint8_t) (debounce_timer - ks->debounce_timestamp) < DEBOUNCE_MS)
+            return;
+
+        status |= KEY_STATUS_STABLE;
+        ks->status = status;
     }
+
+    if ((status & KEY_STATUS_DOWN) == down) return;
+    key_state_register(key_idx, down);
+}
+
+// Local keys changed less than DEBOUNCE_MS ago and still need informing every scan
+static __bit matrix_settling;
+static uint8_t matrix_settle_at;
+
+// Called by the generated scan code with the bits of a port read that differ from the last scan.
+// Returns the bits to inform keys of, which is all of them while any key is still settling.
+uint8_t matrix_port_changes(uint8_t changed) {
+    if (changed) {
+        matrix_settling = 1;
+        matrix_settle_at = debounce_timer;
+    }
+
+    return matrix_settling ? 0xFF : changed;
 }
 
 #ifdef SPLIT_ENABLE
 __bit split_periph_did_not_respond;
+// The event stream has a gap, so the whole state has to be fetched with a burst
+static __bit split_resync;
+// Peripheral keys changed less than DEBOUNCE_MS ago and still need informing every scan
+static __bit split_settling;
+
+// Filled in by the UART0 interrupt, or by split_periph_scan() over soft serial
+__xdata __at(XADDR_SPLIT_RX) uint8_t split_rx[SPLIT_RX_LEN];
+// Last known key_bits and encoder_bits of the peripheral
+__xdata __at(XADDR_SPLIT_PERIPH_STATE) uint8_t split_periph_state[SPLIT_STATE_LEN];
+// Sequence number of the next expected event
+__xdata __at(XADDR_SPLIT_EVENT_SEQ) uint8_t split_event_seq;
+__xdata __at(XADDR_SPLIT_SETTLE_AT) uint8_t split_settle_at;
+__xdata __at(XADDR_SPLIT_STATS) fak_split_stats_t split_stats;
+
+// Resend requests for a response before fetching the whole state instead
+#define SPLIT_MAX_RETRIES 2
+
+// Resend requests left for the current response before giving up on it
+static uint8_t split_retries_left;
+
+#ifndef SPLIT_SOFT_SERIAL_PIN
+// Bytes received since the last request
+static volatile uint8_t split_rx_len;
+static uint8_t split_rx_header;
+// get_timer_ticks() when the last byte came in
+static uint16_t split_rx_last_ticks;
+__xdata __at(XADDR_SPLIT_REQUESTED_AT) uint16_t split_requested_at;
+
+// A response takes well under a millisecond, so anything longer means it's lost
+#define SPLIT_RESPONSE_TIMEOUT_MS 2
+
+// The bytes of a response come one byte time apart (27 ticks at 750k bps). A new response can't
+// start sooner than the request plus its own header take, two byte times after the last byte.
+#define SPLIT_FRAME_GAP_TICKS 40
+
+void UART0_interrupt() {
+    if (TI) TI = 0;
+    if (!RI) return;
+    RI = 0;
 
-static uint8_t split_periph_req(uint8_t request) {
-    split_periph_did_not_respond = 1;
-#ifdef SPLIT_SOFT_SERIAL_PIN
-    soft_serial_sbuf = request;
-    EA = 0;
-    soft_serial_send();
-    soft_serial_recv();
-    EA = 1;
-    split_periph_did_not_respond = soft_serial_did_not_respond;
-    return soft_serial_sbuf;
-#else
+    uint8_t b = SBUF;
+    uint16_t ticks = get_timer_ticks();
+    uint16_t gap = ticks - split_rx_last_ticks;
+    split_rx_last_ticks = ticks;
+
+    // Anything before the header is line noise. So is a header that follows the last byte too
+    // closely, as it's the middle of a late or misaligned response that could pass the CRC by chance.
+    if (split_rx_len == 0 && (b != split_rx_header || gap < SPLIT_FRAME_GAP_TICKS)) return;
+    if (split_rx_len < SPLIT_RX_LEN) split_rx[split_rx_len++] = b;
+}
+
+static void split_periph_send(uint8_t request) {
+    ES = 0;
+    split_rx_len = 0;
+    ES = 1;
+    split_requested_at = get_timer();
     SBUF = request;
-    while (!TI) {}
-    TI = 0;
-    REN = 1;
+}
 
-    request = 0; // Poll 256 times
-    while (!RI) {
-        if (++request == 0) goto exit;
+static void split_periph_request() {
+    split_retries_left = SPLIT_MAX_RETRIES;
+    split_rx_header = split_resync ? SPLIT_MSG_REQUEST_BURST : SPLIT_MSG_REQUEST_CHANGES;
+    split_periph_send(split_rx_header);
+}
+
+static void split_periph_retry() {
+    if (split_retries_left) {
+        split_retries_left--;
+        split_stats.retries++;
+        split_periph_send(SPLIT_MSG_REQUEST_RESEND);
+        return;
     }
-    RI = 0;
-    split_periph_did_not_respond = 0;
-exit:
-    REN = 0;
-    return SBUF;
-#endif
+
+    if (!split_resync) split_stats.resyncs++;
+    split_resync = 1;
+    split_periph_request();
 }
 
-static void split_periph_scan() {
+// Length of the frame in split_rx once it's all in, otherwise 0
+static uint8_t split_rx_frame_len() {
+    uint8_t len = split_rx_len;
+
+    if (len < 4) return 0;
+
+    if (split_rx[0] == SPLIT_MSG_REQUEST_BURST) {
+        return len >= SPLIT_BURST_LEN ? SPLIT_BURST_LEN : 0;
+    }
+
+    // A corrupted count still has to end the frame, so the CRC can reject it
+    if (split_rx[2] > SPLIT_EVENT_QUEUE_LEN) return len;
+    return len >= SPLIT_CHANGES_LEN(split_rx[2]) ? SPLIT_CHANGES_LEN(split_rx[2]) : 0;
+}
+#endif
+
+static void split_periph_settle() {
     uint8_t i = 0;
 
     for (uint8_t b = 0; b < SPLIT_KEY_COUNT_BYTES; b++) {
-        uint8_t resp = split_periph_req(SPLIT_MSG_REQUEST_KEYS + b);
-        if (split_periph_did_not_respond) return;
+        uint8_t bits = split_periph_state[b];
 
         for (uint8_t bit = 0; bit < 8; bit++) {
-            key_state_inform(split_periph_key_indices[i], (resp >> bit) & 1);
+            key_state_inform(split_periph_key_indices[i], (bits >> bit) & 1);
             if (++i == SPLIT_PERIPH_KEY_COUNT) break;
         }
     }
 
+    if ((uint8_t) (debounce_timer - split_settle_at) > DEBOUNCE_MS) split_settling = 0;
+}
+
+static void split_periph_apply_burst() {
+    for (uint8_t i = 0; i < SPLIT_STATE_LEN; i++) {
+        split_periph_state[i] = split_rx[2 + i];
+    }
+
+    split_event_seq = split_rx[1];
+    split_resync = 0;
+    split_settling = 1;
+    split_settle_at = debounce_timer;
+
 #if SPLIT_ENCODER_COUNT_BYTES > 0
-    i = 0;
+    for (uint8_t i = 0; i < SPLIT_PERIPH_ENCODER_COUNT; i++) {
+        uint8_t bits = split_periph_state[SPLIT_KEY_COUNT_BYTES + i / 4];
+        encoder_scan(split_periph_encoder_indices[i], (bits >> ((i % 4) * 2)) & 0x03);
+    }
+#endif
+}
 
-    for (uint8_t b = 0; b < SPLIT_ENCODER_COUNT_BYTES; b++) {
-        uint8_t resp = split_periph_req(SPLIT_MSG_REQUEST_ENCODERS + b);
-        if (split_periph_did_not_respond) return;
+static void split_periph_apply_changes() {
+    uint8_t count = split_rx[2];
 
-        for (uint8_t j = 0; j < 4; j++) {
-            encoder_scan(split_periph_encoder_indices[i], (resp >> (j * 2)) & 0x03);
-            if (++i == SPLIT_PERIPH_ENCODER_COUNT) break;
+    if (split_rx[1] != split_event_seq) {
+        split_stats.resyncs++;
+        split_resync = 1;
+        return;
+    }
+
+    split_event_seq += count;
+
+    for (uint8_t i = 0; i < count; i++) {
+        uint8_t idx = split_rx[3 + i * 2];
+        uint8_t value = split_rx[4 + i * 2];
+
+        if (idx < SPLIT_PERIPH_KEY_COUNT) {
+            uint8_t bit = 1 << (idx % 8);
+            split_periph_state[idx / 8] = split_periph_state[idx / 8] & ~bit | (value ? bit : 0);
+            split_settling = 1;
+            split_settle_at = debounce_timer;
+        }
+#if SPLIT_ENCODER_COUNT_BYTES > 0
+        else if ((idx -= SPLIT_PERIPH_KEY_COUNT) < SPLIT_PERIPH_ENCODER_COUNT) {
+            // Applied in order, as every step of the quadrature sequence counts
+            uint8_t shift = (idx % 4) * 2;
+            uint8_t *bits = &split_periph_state[SPLIT_KEY_COUNT_BYTES + idx / 4];
+            *bits = *bits & ~(0x03 << shift) | (value << shift);
+            encoder_scan(split_periph_encoder_indices[idx], value);
+        }
+#endif
+    }
+}
+
+static void split_periph_apply_rx() {
+    if (split_rx[0] == SPLIT_MSG_REQUEST_BURST) {
+        split_periph_apply_burst();
+    } else {
+        split_periph_apply_changes();
+    }
+}
+
+// Only changes are requested once in sync, so an idle peripheral costs one short round trip
+// and no per-key work beyond the debounce window of the last change.
+#ifdef SPLIT_SOFT_SERIAL_PIN
+// Receives a framed response into split_rx and returns its length, or 0 if it didn't come in whole
+static uint8_t split_periph_recv_frame(uint8_t header) {
+    uint8_t len = header == SPLIT_MSG_REQUEST_BURST ? SPLIT_BURST_LEN : SPLIT_CHANGES_LEN(0);
+
+    for (uint8_t i = 0; i < len; i++) {
+        soft_serial_recv();
+        if (soft_serial_did_not_respond) return 0;
+        split_rx[i] = soft_serial_sbuf;
+
+        if (i == 0 && soft_serial_sbuf != header) return 0;
+        if (i == 2 && header == SPLIT_MSG_REQUEST_CHANGES) {
+            // Too many to be real, so the count itself is corrupted
+            if (soft_serial_sbuf > SPLIT_EVENT_QUEUE_LEN) return 0;
+            len = SPLIT_CHANGES_LEN(soft_serial_sbuf);
         }
     }
+
+    return len;
+}
+
+#ifdef SPLIT_SOFT_SERIAL_CALIBRATE
+// Bursts that must all get through for a rate to pass
+#define SPLIT_CALIBRATION_TRIALS 100
+// Longer than the peripheral takes to fall back to the configured rate by itself
+#define SPLIT_CALIBRATION_FALLBACK_MS 100
+
+static __bit split_calibrated;
+
+// Sent at the current rate, so this only fails if that one is already bad
+static __bit split_periph_set_rate(uint8_t bit_loops) {
+    EA = 0;
+    soft_serial_sbuf = SPLIT_MSG_REQUEST_SET_RATE;
+    soft_serial_send();
+    soft_serial_gap();
+    soft_serial_sbuf = bit_loops;
+    soft_serial_send();
+    soft_serial_recv();
+    EA = 1;
+
+    if (soft_serial_did_not_respond || soft_serial_sbuf != bit_loops) return 0;
+    soft_serial_set_bit_loops(bit_loops);
+    return 1;
+}
+
+static __bit split_periph_trial() {
+    for (uint8_t i = SPLIT_CALIBRATION_TRIALS; i; i--) {
+        soft_serial_sbuf = SPLIT_MSG_REQUEST_BURST;
+        EA = 0;
+        soft_serial_send();
+        uint8_t len = split_periph_recv_frame(SPLIT_MSG_REQUEST_BURST);
+        EA = 1;
+
+        if (!len || crc8(split_rx, len - 1) != split_rx[len - 1]) return 0;
+    }
+
+    return 1;
+}
+
+// Steps the bit rate up until a trial fails and reports the fastest clean one in split_stats
+static void split_periph_calibrate() {
+    uint8_t best = SOFT_SERIAL_DEFAULT_BIT_LOOPS;
+
+    for (uint8_t loops = SOFT_SERIAL_DEFAULT_BIT_LOOPS - 1; loops; loops--) {
+        if (!split_periph_set_rate(loops) || !split_periph_trial()) break;
+        best = loops;
+    }
+
+    if (!split_periph_set_rate(SOFT_SERIAL_DEFAULT_BIT_LOOPS)) {
+        soft_serial_set_bit_loops(SOFT_SERIAL_DEFAULT_BIT_LOOPS);
+        delay(SPLIT_CALIBRATION_FALLBACK_MS);
+    }
+
+    split_stats.soft_serial_bit_cycles = SOFT_SERIAL_BIT_CYCLES(best);
+    // Trial bursts drained the peripheral's changes
+    split_resync = 1;
+}
+#endif
+
+static void split_periph_scan() {
+#ifdef SPLIT_SOFT_SERIAL_CALIBRATE
+    // Only once the peripheral is known to be up
+    if (!split_calibrated && !split_resync) {
+        split_calibrated = 1;
+        split_periph_calibrate();
+    }
 #endif
+
+    uint8_t header = split_resync ? SPLIT_MSG_REQUEST_BURST : SPLIT_MSG_REQUEST_CHANGES;
+    uint8_t request = header;
+
+    split_periph_did_not_respond = 1;
+
+    for (uint8_t attempt = 0; attempt <= SPLIT_MAX_RETRIES; attempt++) {
+        if (attempt) {
+            split_stats.retries++;
+            request = SPLIT_MSG_REQUEST_RESEND;
+        }
+
+        soft_serial_sbuf = request;
+        EA = 0;
+        soft_serial_send();
+        uint8_t len = split_periph_recv_frame(header);
+        EA = 1;
+
+        if (!len) {
+            split_stats.timeouts++;
+        } else if (crc8(split_rx, len - 1) != split_rx[len - 1]) {
+            split_stats.crc_errors++;
+        } else {
+            split_stats.frames++;
+            split_periph_did_not_respond = 0;
+            split_periph_apply_rx();
+            break;
+        }
+    }
+
+    if (split_periph_did_not_respond) {
+        // Whatever the peripheral drained is lost
+        if (!split_resync) split_stats.resyncs++;
+        split_resync = 1;
+    }
+
+    if (split_settling) split_periph_settle();
 }
+#else
+// The next response is requested as soon as the last one is in,
+// and comes in through the UART0 interrupt while the rest of the scan runs.
+static void split_periph_scan() {
+    uint8_t len = split_rx_frame_len();
+
+    if (len) {
+        if (crc8(split_rx, len - 1) != split_rx[len - 1]) {
+            split_stats.crc_errors++;
+            split_periph_retry();
+        } else {
+            split_stats.frames++;
+            split_periph_did_not_respond = 0;
+            split_periph_apply_rx();
+            split_periph_request();
+        }
+    } else if (timer_elapsed(split_requested_at) >= SPLIT_RESPONSE_TIMEOUT_MS) {
+        split_stats.timeouts++;
+        split_periph_did_not_respond = 1;
+        split_periph_retry();
+    }
+
+    if (split_settling) split_periph_settle();
+}
+#endif
 #endif
 
 void keyboard_init() {
+    // Keys start up and stable so the first press after boot can register eagerly
     for (uint8_t i = KEY_COUNT; i;) {
-        key_states[--i].status = 0;
+        key_states[--i].status = KEY_STATUS_STABLE;
+        key_states[i].debounce_timestamp = 0;
     }
 
     for (uint8_t i = 8; i;) {
         strong_mods_ref_count[--i] = 0;
     }
 
+    deadlines_init();
+    key_events_releases_reserved = 0;
+    matrix_settling = 0;
+
 #ifdef SPLIT_SOFT_SERIAL_PIN
     soft_serial_init();
 #endif
+#ifdef SPLIT_ENABLE
+    for (uint8_t i = SPLIT_STATE_LEN; i;) {
+        split_periph_state[--i] = 0;
+    }
+    split_resync = 1;
+    split_settling = 0;
+    split_stats.frames = 0;
+    split_stats.crc_errors = 0;
+    split_stats.timeouts = 0;
+    split_stats.retries = 0;
+    split_stats.resyncs = 0;
+#ifdef SPLIT_SOFT_SERIAL_CALIBRATE
+    split_stats.soft_serial_bit_cycles = 0;
+    split_calibrated = 0;
+#endif
+#ifndef SPLIT_SOFT_SERIAL_PIN
+    REN = 1;
+    ES = 1;
+    split_periph_request();
+#endif
+#endif
+#if LAYER_COUNT > 1
+    keymap_init();
+#endif
 #if COMBO_COUNT > 0
     combo_init();
 #endif
 #if ENCODER_COUNT > 0
     encoder_init();
+#endif
+#ifdef MACRO_KEYS_ENABLE
+    macro_init();
 #endif
     key_event_queue_init();
     keyboard_init_user();
 }
 
 void keyboard_scan() {
+#ifdef USB_SOF_SYNC_ENABLE
+    USB_SOF_wait_scan_slot();
+#endif
+    debounce_timer = get_timer();
+    deadlines_poll();
     keyboard_scan_user();
+    if (matrix_settling && (uint8_t) (debounce_timer - matrix_settle_at) > DEBOUNCE_MS) matrix_settling = 0;
 #ifdef SPLIT_ENABLE
     split_periph_scan();
 #endif
-    delay(DEBOUNCE_MS);
 #if COMBO_COUNT > 0
     combo_handle();
 #endif
 #ifdef MOUSE_KEYS_ENABLE
     mouse_process();
+#endif
+#ifdef MACRO_KEYS_ENABLE
+    macro_process();
+#endif
+#ifdef CAPS_WORD_ENABLE
+    if (deadline_due(DEADLINE_CAPS_WORD)) caps_word_off();
 #endif
     handle_key_events();
+#ifdef NEOPIXEL_ENABLE
+    neopixel_process();
+#endif
+#ifdef USB_SOF_SYNC_ENABLE
+    USB_SOF_scan_done();
+#endif
 }
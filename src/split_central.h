@@ -9,6 +9,9 @@
 #define KEY_STATUS_DOWN 0x01
 #define KEY_STATUS_DEBOUNCE 0x02
 #define KEY_STATUS_RESOLVED 0x04
+#define KEY_STATUS_STABLE 0x08
+#define KEY_STATUS_PRESS_QUEUED 0x10 // The key event queue keeps room for its release
+#define KEY_STATUS_PRESS_DROPPED 0x20 // Its press didn't fit in the key event queue, so its release is dropped too
 
 #define HANDLE_RESULT_MAPPED 0x01
 #define HANDLE_RESULT_COMPLETED 0x02
@@ -26,8 +29,26 @@
 typedef struct {
     uint8_t status;
     uint32_t key_code;
+    uint8_t debounce_timestamp; // Low byte of the timer at the last raw edge
 } fak_key_state_t;
 
+#ifdef SPLIT_ENABLE
+// Read by the host as the keyboard interface's feature report with SPLIT_STATS_REPORT_ENABLE
+typedef struct {
+    uint16_t frames;
+    uint16_t crc_errors;
+    uint16_t timeouts;
+    uint16_t retries;
+    uint16_t resyncs;
+#ifdef SPLIT_SOFT_SERIAL_CALIBRATE
+    // Fastest soft serial rate that passed calibration, as CPU cycles per bit
+    uint16_t soft_serial_bit_cycles;
+#endif
+} fak_split_stats_t;
+
+extern __xdata fak_split_stats_t split_stats;
+#endif
+
 typedef struct {
     uint8_t type;
     union {
@@ -38,10 +59,12 @@ typedef struct {
 void push_key_event(uint8_t key_idx, uint8_t pressed);
 void handle_non_future(uint32_t key_code, uint8_t down);
 void tap_non_future(uint32_t key_code);
+uint8_t key_report_has_room(uint32_t key_code);
 uint32_t get_real_key_code(uint8_t key_idx);
 uint8_t get_future_type(uint32_t key_code);
 uint16_t get_last_tap_timestamp();
 void key_state_inform(uint8_t key_idx, uint8_t down);
+uint8_t matrix_port_changes(uint8_t changed);
 
 void keyboard_init();
 void keyboard_scan();
@@ -2,6 +2,7 @@
 #include "ch55x.h"
 #include "time.h"
 #include "bootloader.h"
+#include "crc8.h"
 
 #ifdef SPLIT_SOFT_SERIAL_PIN
 #include "soft_serial.h"
@@ -26,14 +27,115 @@ static uint8_t response_to(uint8_t request) {
     return 0;
 }
 
+// Changes since the last request, drained by SPLIT_MSG_REQUEST_CHANGES
+typedef struct {
+    uint8_t idx; // Key index, or SPLIT_PERIPH_KEY_COUNT + encoder index
+    uint8_t value;
+} split_event_t;
+
+static split_event_t split_events[SPLIT_EVENT_QUEUE_LEN];
+static uint8_t split_events_size;
+// Sequence number of split_events[0]. Skipping ahead tells the central it missed something.
+static uint8_t split_event_seq;
+
+// The last response, kept for SPLIT_MSG_REQUEST_RESEND
+static uint8_t split_tx[SPLIT_RX_LEN];
+static uint8_t split_tx_len;
+
+static void push_split_event(uint8_t idx, uint8_t value) {
+    if (split_events_size == SPLIT_EVENT_QUEUE_LEN) {
+        // Overflow. Drop everything and let the central resync with a burst.
+        split_event_seq += SPLIT_EVENT_QUEUE_LEN + 1;
+        split_events_size = 0;
+        return;
+    }
+
+    split_events[split_events_size].idx = idx;
+    split_events[split_events_size].value = value;
+    split_events_size++;
+}
+
+// Fills split_tx with the response to a request and returns its length
+static uint8_t prepare_response(uint8_t request) {
+    uint8_t len = 0;
+
+    if (request == SPLIT_MSG_REQUEST_RESEND) {
+        return split_tx_len;
+    }
+
+    if (request == SPLIT_MSG_REQUEST_BURST) {
+        // The snapshot covers whatever is queued
+        split_event_seq += split_events_size;
+        split_events_size = 0;
+
+        split_tx[len++] = SPLIT_MSG_REQUEST_BURST;
+        split_tx[len++] = split_event_seq;
+        for (uint8_t i = 0; i < SPLIT_KEY_COUNT_BYTES; i++) {
+            split_tx[len++] = key_bits[i];
+        }
+#if SPLIT_ENCODER_COUNT_BYTES > 0
+        for (uint8_t i = 0; i < SPLIT_ENCODER_COUNT_BYTES; i++) {
+            split_tx[len++] = encoder_bits[i];
+        }
+#endif
+    } else if (request == SPLIT_MSG_REQUEST_CHANGES) {
+        split_tx[len++] = SPLIT_MSG_REQUEST_CHANGES;
+        split_tx[len++] = split_event_seq;
+        split_tx[len++] = split_events_size;
+        for (uint8_t i = 0; i < split_events_size; i++) {
+            split_tx[len++] = split_events[i].idx;
+            split_tx[len++] = split_events[i].value;
+        }
+
+        split_event_seq += split_events_size;
+        split_events_size = 0;
+    } else {
+        split_tx[0] = response_to(request);
+        // Not framed, so there's nothing to resend
+        split_tx_len = 0;
+        return 1;
+    }
+
+    split_tx[len] = crc8(split_tx, len);
+    split_tx_len = ++len;
+    return len;
+}
+
 #ifdef SPLIT_SOFT_SERIAL_PIN
+#ifdef SPLIT_SOFT_SERIAL_CALIBRATE
+// Scans in a row without a request while on a trial rate, before falling back to the configured one
+#define SPLIT_TRIAL_RATE_IDLE_SCANS 2
+
+static uint8_t trial_rate_idle_scans;
+
+static void switch_rate() {
+    soft_serial_recv();
+    if (soft_serial_did_not_respond || soft_serial_sbuf == 0) return;
+
+    soft_serial_gap();
+    soft_serial_send();
+    soft_serial_set_bit_loops(soft_serial_sbuf);
+    trial_rate_idle_scans = soft_serial_sbuf == SOFT_SERIAL_DEFAULT_BIT_LOOPS ? 0 : SPLIT_TRIAL_RATE_IDLE_SCANS;
+}
+#endif
+
 uint8_t try_respond_to_soft_serial_request() {
     EA = 0;
     soft_serial_recv();
     
+#ifdef SPLIT_SOFT_SERIAL_CALIBRATE
+    if (!soft_serial_did_not_respond && soft_serial_sbuf == SPLIT_MSG_REQUEST_SET_RATE) {
+        switch_rate();
+    } else
+#endif
     if (!soft_serial_did_not_respond) {
-        soft_serial_sbuf = response_to(soft_serial_sbuf);
-        soft_serial_send();
+        uint8_t len = prepare_response(soft_serial_sbuf);
+
+        for (uint8_t i = 0; i < len; i++) {
+            if (i) soft_serial_gap();
+            soft_serial_sbuf = split_tx[i];
+            soft_serial_send();
+        }
     }
 
     EA = 1;
@@ -50,16 +152,24 @@ void key_state_inform(uint8_t key_idx, uint8_t down) {
     }
 
     uint8_t shift = key_idx % 8;
+    uint8_t bits = key_bits[key_idx / 8];
+    if (((bits >> shift) & 1) == down) return;
+
     ES = 0;
-    key_bits[key_idx / 8] = (key_bits[key_idx / 8] & ~(1 << shift)) | (down << shift);
+    key_bits[key_idx / 8] = (bits & ~(1 << shift)) | (down << shift);
+    push_split_event(key_idx, down);
     ES = 1;
 }
 
 #if SPLIT_ENCODER_COUNT_BYTES > 0
 void encoder_scan(uint8_t encoder_idx, uint8_t reading) {
     uint8_t shift = (encoder_idx % 4) * 2;
+    uint8_t bits = encoder_bits[encoder_idx / 4];
+    if (((bits >> shift) & 0x03) == reading) return;
+
     ES = 0;
-    encoder_bits[encoder_idx / 4] = encoder_bits[encoder_idx / 4] & ~(0x03 << shift) | (reading << shift);
+    encoder_bits[encoder_idx / 4] = bits & ~(0x03 << shift) | (reading << shift);
+    push_split_event(SPLIT_PERIPH_KEY_COUNT + encoder_idx, reading);
     ES = 1;
 }
 #endif
@@ -75,7 +185,9 @@ void keyboard_init() {
     }
 #endif
 
-#ifndef SPLIT_SOFT_SERIAL_PIN
+#ifdef SPLIT_SOFT_SERIAL_PIN
+    soft_serial_init();
+#else
     REN = 1;
     ES = 1;
 #endif
@@ -97,6 +209,15 @@ void keyboard_scan() {
             break;
         }
     }
+
+#ifdef SPLIT_SOFT_SERIAL_CALIBRATE
+    // The central can't reach us on a rate that doesn't work, so we have to go back by ourselves
+    if (responding) {
+        if (trial_rate_idle_scans) trial_rate_idle_scans = SPLIT_TRIAL_RATE_IDLE_SCANS;
+    } else if (trial_rate_idle_scans && !--trial_rate_idle_scans) {
+        soft_serial_set_bit_loops(SOFT_SERIAL_DEFAULT_BIT_LOOPS);
+    }
+#endif
 #endif
 }
 
@@ -106,9 +227,14 @@ void UART0_interrupt() {
     RI = 0;
     REN = 0;
 
-    SBUF = response_to(SBUF);
-    while (!TI);
-    TI = 0;
+    uint8_t len = prepare_response(SBUF);
+
+    for (uint8_t i = 0; i < len; i++) {
+        SBUF = split_tx[i];
+        while (!TI);
+        TI = 0;
+    }
+
     REN = 1;
 }
 #endif
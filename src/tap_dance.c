@@ -1,5 +1,6 @@
 #include "tap_dance.h"
 #include "keymap.h"
+#include "deadline.h"
 
 __xdata __at(XADDR_TAP_COUNT) uint8_t tap_count = 1;
 
@@ -7,10 +8,10 @@ uint8_t is_future_type_tap_dance(uint32_t key_code) {
     return (key_code >> 24) == 0xE0;
 }
 
-uint8_t tap_dance_handle_event(fak_key_state_t *ks, uint8_t handle_ev, int16_t delta) {
+uint8_t tap_dance_handle_event(fak_key_state_t *ks, uint8_t handle_ev, uint16_t delta) {
     fak_key_event_t *ev_front = key_event_queue_front();
 
-    if (handle_ev == HANDLE_EVENT_QUEUED && !ev_front->pressed) {
+    if (handle_ev == HANDLE_EVENT_QUEUED && !KEY_EVENT_PRESSED(ev_front)) {
         return HANDLE_RESULT_COMPLETED;
     }
 
@@ -25,7 +26,7 @@ uint8_t tap_dance_handle_event(fak_key_state_t *ks, uint8_t handle_ev, int16_t d
         fak_key_event_t *ev_in = key_event_queue_bfront();
 
         if (ev_front->key_idx == ev_in->key_idx) {
-            if (!ev_in->pressed) return 0;
+            if (!KEY_EVENT_PRESSED(ev_in)) return 0;
             tap_count++;
             return HANDLE_RESULT_COMPLETED;
         }
@@ -37,3 +38,15 @@ uint8_t tap_dance_handle_event(fak_key_state_t *ks, uint8_t handle_ev, int16_t d
     
     return HANDLE_RESULT_MAPPED;
 }
+
+// Pre-scan handling waits for this, the end of the tapping term after the last tap
+void tap_dance_update_deadline(fak_key_state_t *ks) {
+    uint8_t max_taps = (ks->key_code >> 20) & 0xF;
+    uint16_t at = key_event_queue_front()->timestamp;
+
+    if (tap_count < max_taps) {
+        at += (ks->key_code >> 8) & 0xFFF;
+    }
+
+    deadline_set(DEADLINE_FUTURE_KEY, at);
+}
@@ -7,7 +7,8 @@
 
 uint8_t is_future_type_tap_dance(uint32_t key_code);
 
-uint8_t tap_dance_handle_event(fak_key_state_t *ks, uint8_t handle_ev, int16_t delta);
+uint8_t tap_dance_handle_event(fak_key_state_t *ks, uint8_t handle_ev, uint16_t delta);
+void tap_dance_update_deadline(fak_key_state_t *ks);
 
 extern __code uint32_t tap_dance_bindings[];
 
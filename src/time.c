@@ -3,6 +3,11 @@
 
 __idata volatile uint16_t timer_1ms;
 
+#ifdef USB_SOF_SYNC_ENABLE
+// Reloaded on every SOF with some slack, so Timer0 only overflows and takes over ticking if SOFs stop
+#define TIMER0_SOF_RELOAD (65536 - TIMER0_TICKS_PER_MS - 100)
+#endif
+
 void delay(uint16_t ms) {
     while (ms) {
 #if CH55X == 2
@@ -21,14 +26,59 @@ void delay(uint16_t ms) {
     }
 }
 
+// timer_1ms is read a byte at a time, so it is read again until a tick didn't land in between.
+// Ticks are a millisecond apart, which leaves plenty of room to get two matching reads.
 uint16_t get_timer() {
     uint16_t ret;
-    ET0 = 0;
-    ret = timer_1ms;
-    ET0 = 1;
+
+    do {
+        ret = timer_1ms;
+    } while (ret != timer_1ms);
+
     return ret;
 }
 
+// Timer0 counts up from here and overflows into the next millisecond
+#ifdef USB_SOF_SYNC_ENABLE
+#define TIMER0_RELOAD TIMER0_SOF_RELOAD
+#else
+#define TIMER0_RELOAD (65536 - TIMER0_TICKS_PER_MS)
+#endif
+
+// Also called from the UART0 interrupt, so its locals mustn't share memory with the main loop's
+#pragma save
+#pragma nooverlay
+uint16_t get_timer_ticks() {
+    uint16_t ms;
+    uint16_t ticks;
+    uint8_t h, l;
+    __bit overflowed;
+
+    // Read again if a tick or a carry into TH0 landed in between
+    do {
+        ms = timer_1ms;
+        h = TH0;
+        l = TL0;
+        overflowed = TF0;
+    } while (h != TH0 || ms != timer_1ms);
+
+    ticks = ((uint16_t) h << 8) | l;
+
+    if (overflowed) {
+        // Not serviced yet. Timer0 carried on from 0 into the next millisecond.
+        ms++;
+    } else {
+        ticks -= TIMER0_RELOAD;
+    }
+
+    // A late SOF or a late tick can stretch a millisecond, which mustn't run into the next one
+    if (ticks >= TIMER0_TICKS_PER_MS) ticks = TIMER0_TICKS_PER_MS - 1;
+
+    // ms * TIMER0_TICKS_PER_MS (2048 - 32 - 16) in shifts. The library multiply isn't safe in an interrupt.
+    return (ms << 11) - (ms << 5) - (ms << 4) + ticks;
+}
+#pragma restore
+
 static inline void enter_safe_mode() {
     SAFE_MOD = 0x55;
     SAFE_MOD = 0xAA;
@@ -59,6 +109,27 @@ void TMR0_interrupt() {
 }
 #pragma restore
 
+#ifdef USB_SOF_SYNC_ENABLE
+// Called from the USB interrupt on every SOF, in place of the Timer0 tick
+void timer_sync_to_sof() {
+    TL0 = TIMER0_SOF_RELOAD & 0xFF;
+    TH0 = TIMER0_SOF_RELOAD >> 8;
+    timer_1ms++;
+}
+
+// Timer0 ticks since the last SOF
+uint16_t get_frame_ticks() {
+    uint8_t h, l;
+
+    do {
+        h = TH0;
+        l = TL0;
+    } while (h != TH0);
+
+    return (((uint16_t) h << 8) | l) - TIMER0_SOF_RELOAD;
+}
+#endif
+
 void TMR0_init() {
     TL0 = 0x30;
     TH0 = 0xF8; // 65536 - 2000 = 63536
@@ -1,12 +1,29 @@
 #ifndef __TIME_H__
 #define __TIME_H__
 
+#include <stdint.h>
+
+// Timer0 runs at Fsys / 12 = 2 MHz
+#define TIMER0_TICKS_PER_MS 2000
+
 void delay(uint16_t ms);
 uint16_t get_timer();
 
+// Free-running count of Timer0 ticks that wraps every 32.768 ms. For timing short intervals,
+// like the gaps between split frames in the UART0 interrupt.
+uint16_t get_timer_ticks();
+
+// Wrap-safe time since a get_timer() value, good for up to 65535 ms
+#define timer_elapsed(since) ((uint16_t) (get_timer() - (since)))
+
 void CLK_init();
 
 void TMR0_interrupt();
 void TMR0_init();
 
+#ifdef USB_SOF_SYNC_ENABLE
+void timer_sync_to_sof();
+uint16_t get_frame_ticks();
+#endif
+
 #endif
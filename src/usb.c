@@ -1,6 +1,10 @@
 #include "usb.h"
 #include "ch55x.h"
 #include "math.h"
+#include "time.h"
+#ifdef SPLIT_ENABLE
+#include "split_central.h"
+#endif
 
 #include <string.h>
 
@@ -8,6 +12,8 @@
 #define MSB(u16) (u16 >> 8)
 #define LSB(u16) (u16 & 0xFF)
 
+#define HID_REPORT_TYPE_FEATURE 3
+
 #ifdef USB_MANUFACTURER_STR
 #define USB_MANUFACTURER_STR_IDX 1
 #else
@@ -61,7 +67,7 @@ typedef struct {
 #endif
 } USB_CFG1_DESCR;
 
-__code uint8_t *p_usb_tx;
+uint8_t *p_usb_tx;
 __xdata __at(XADDR_USB_TX_LEN) uint8_t usb_tx_len;
 
 __bit hid_protocol_keyboard;
@@ -72,6 +78,45 @@ __bit hid_protocol_mouse;
 __xdata __at(XADDR_USB_EP0) uint8_t EP0_buffer[USB_EP0_SIZE];
 __xdata __at(XADDR_USB_EP1) uint8_t EP1I_buffer[USB_EP1_SIZE];
 
+#if (USB_EP1I_FIFO_LEN & (USB_EP1I_FIFO_LEN - 1)) != 0
+#error "USB_EP1I_FIFO_LEN must be a power of two"
+#endif
+
+typedef struct {
+    uint8_t q[USB_EP1I_FIFO_LEN][USB_EP1_SIZE];
+    uint8_t head;
+    volatile uint8_t size;
+} usb_report_fifo_t;
+
+// The keyboard report as the firmware sees it. EP1I_buffer only holds what's in flight.
+__xdata __at(XADDR_USB_EP1I_REPORT) uint8_t EP1I_report[USB_EP1_SIZE];
+// Reports waiting for EP1I_buffer to be taken by the host
+__xdata __at(XADDR_USB_EP1I_FIFO) usb_report_fifo_t EP1I_fifo;
+
+#ifdef USB_SOF_SYNC_ENABLE
+// Frame-relative timings, in Timer0 ticks since the last SOF
+typedef struct {
+    uint16_t frames;
+    uint16_t reports;
+    // Largest SOF-to-report delay seen. Anything under a frame makes it in the next frame.
+    uint16_t report_ticks_max;
+    // Scans that couldn't start in time to finish before the next SOF
+    uint16_t late_scans;
+    // Running estimate of how long keyboard_scan() takes
+    uint16_t scan_ticks;
+    uint16_t scan_start_ticks;
+} usb_sof_stats_t;
+
+__xdata __at(XADDR_USB_SOF_STATS) usb_sof_stats_t usb_sof_stats;
+
+#define SOF_SCAN_MARGIN_TICKS 40
+#endif
+
+// EP1I_buffer is armed and waiting for the host to poll
+volatile __bit EP1I_busy;
+// The newest pending report can still absorb changes instead of queueing another one
+__bit EP1I_tail_open;
+
 #ifdef CONSUMER_KEYS_ENABLE
 __xdata __at(XADDR_USB_EP2) uint16_t EP2I_buffer[USB_EP2_SIZE / 2];
 #endif
@@ -142,7 +187,7 @@ __code USB_CFG1_DESCR USB_CONFIG1_DESCR = {
         .bmAttributes = USB_ENDP_TYPE_INTER,
         .wMaxPacketSizeL = LSB(USB_EP1_SIZE),
         .wMaxPacketSizeH = MSB(USB_EP1_SIZE),
-        .bInterval = 1
+        .bInterval = USB_EP1_INTERVAL
     },
 #ifdef CONSUMER_KEYS_ENABLE
     .itf_consumer_descr = {
@@ -174,7 +219,7 @@ __code USB_CFG1_DESCR USB_CONFIG1_DESCR = {
         .bmAttributes = USB_ENDP_TYPE_INTER,
         .wMaxPacketSizeL = LSB(USB_EP2_SIZE),
         .wMaxPacketSizeH = MSB(USB_EP2_SIZE),
-        .bInterval = 1
+        .bInterval = USB_EP2_INTERVAL
     },
 #endif
 #ifdef MOUSE_KEYS_ENABLE
@@ -207,11 +252,44 @@ __code USB_CFG1_DESCR USB_CONFIG1_DESCR = {
         .bmAttributes = USB_ENDP_TYPE_INTER,
         .wMaxPacketSizeL = LSB(USB_EP3_SIZE),
         .wMaxPacketSizeH = MSB(USB_EP3_SIZE),
-        .bInterval = 1
+        .bInterval = USB_EP3_INTERVAL
     },
 #endif
 };
 
+#ifdef NKRO_ENABLE
+#define NKRO_USAGE_COUNT ((USB_EP1_SIZE - 1) * 8)
+
+// In boot protocol, the host ignores this and expects the 6KRO layout instead
+__code uint8_t USB_HID_REPORT_DESCR[] = {
+    0x05, 0x01,                     // Usage Page (Generic Desktop)
+    0x09, 0x06,                     // Usage (Keyboard)
+    0xA1, 0x01,                     // Collection (Application)
+    0x05, 0x07,                     //      Usage Page (Key Codes)
+    0x19, 0xE0,                     //      Usage Minimum (224)
+    0x29, 0xE7,                     //      Usage Maximum (231)
+    0x15, 0x00,                     //      Logical Minimum (0)
+    0x25, 0x01,                     //      Logical Maximum (1)
+    0x75, 0x01,                     //      Report Size (1)
+    0x95, 0x08,                     //      Report Count (8)
+    0x81, 0x02,                     //      Input (Data, Var, Abs)
+    0x19, 0x00,                     //      Usage Minimum (0)
+    0x29, NKRO_USAGE_COUNT - 1,     //      Usage Maximum
+    0x95, NKRO_USAGE_COUNT,         //      Report Count
+    0x81, 0x02,                     //      Input (Data, Var, Abs)
+#ifdef SPLIT_STATS_REPORT_ENABLE
+    // Split link statistics, see fak_split_stats_t
+    0x06, 0x00, 0xFF,               //      Usage Page (Vendor Defined 0xFF00)
+    0x09, 0x01,                     //      Usage (1)
+    0x15, 0x00,                     //      Logical Minimum (0)
+    0x26, 0xFF, 0x00,               //      Logical Maximum (255)
+    0x75, 0x08,                     //      Report Size (8)
+    0x95, sizeof(fak_split_stats_t),//      Report Count
+    0xB1, 0x02,                     //      Feature (Data, Var, Abs)
+#endif
+    0xC0
+};
+#else
 __code uint8_t USB_HID_REPORT_DESCR[] = {
     0x05, 0x01,
     0x09, 0x06,
@@ -235,8 +313,18 @@ __code uint8_t USB_HID_REPORT_DESCR[] = {
     0x19, 0x00,
     0x29, 0x65,
     0x81, 0x00,
+#ifdef SPLIT_STATS_REPORT_ENABLE
+    0x06, 0x00, 0xFF,
+    0x09, 0x01,
+    0x15, 0x00,
+    0x26, 0xFF, 0x00,
+    0x75, 0x08,
+    0x95, sizeof(fak_split_stats_t),
+    0xB1, 0x02,
+#endif
     0xC0
 };
+#endif
 
 #ifdef CONSUMER_KEYS_ENABLE
 __code uint8_t USB_HID_CONSUMER_REPORT_DESCR[] = {
@@ -244,7 +332,7 @@ __code uint8_t USB_HID_CONSUMER_REPORT_DESCR[] = {
     0x09, 0x01,                     // Usage (Consumer Control)
     0xA1, 0x01,                     // Collection (Application)
     0x75, 0x10,                     //      Report Size (16)
-    0x95, 0x04,                     //      Report Count (4)
+    0x95, USB_EP2_SIZE / 2,         //      Report Count
     0x26, 0xFF, 0x03,               //      Logical Maximum (1023)
     0x19, 0x00,                     //      Usage Minimum (0)
     0x2A, 0xFF, 0x03,               //      Usage Maximum (1023)
@@ -314,6 +402,22 @@ __code uint8_t USB_STR3_DESCR[] = {
 #endif
 #endif
 
+#ifdef NKRO_ENABLE
+// Both report layouts share the modifiers byte. Keys held across a switch are released.
+static void USB_EP1I_set_protocol(uint8_t protocol) {
+    if (hid_protocol_keyboard == protocol)
+        return;
+
+    hid_protocol_keyboard = protocol;
+
+    for (uint8_t i = 1; i < USB_EP1_SIZE; i++) {
+        EP1I_report[i] = 0;
+    }
+
+    UEP1_T_LEN = protocol ? USB_EP1_SIZE : USB_EP1I_BOOT_REPORT_SIZE;
+}
+#endif
+
 static void USB_EP0_tx() {
     UEP0_T_LEN = MIN(usb_tx_len, USB_EP0_SIZE);
 
@@ -423,10 +527,29 @@ inline static void USB_EP0_SETUP() {
             if (setupPacket->bRequestType == (USB_REQ_TYP_IN | USB_REQ_TYP_CLASS | USB_REQ_RECIP_INTERF)) {
                 switch (setupPacket->wIndexL) {
                 case ITF_NUM_KEYBOARD:
+#ifdef SPLIT_STATS_REPORT_ENABLE
+                    if (setupPacket->wValueH == HID_REPORT_TYPE_FEATURE) {
+                        usb_tx_len = sizeof(fak_split_stats_t);
+                        p_usb_tx = (uint8_t *) &split_stats;
+                        if (usb_tx_len > setupPacket->wLengthL) usb_tx_len = setupPacket->wLengthL;
+                        UDEV_CTRL |= bUD_GP_BIT;
+                        USB_EP0_tx();
+                        return;
+                    }
+#endif
+#ifdef NKRO_ENABLE
+                    // The bitmap report doesn't fit in one EP0 packet, so send it like a descriptor
+                    usb_tx_len = hid_protocol_keyboard ? USB_EP1_SIZE : USB_EP1I_BOOT_REPORT_SIZE;
+                    p_usb_tx = EP1I_report;
+                    if (usb_tx_len > setupPacket->wLengthL) usb_tx_len = setupPacket->wLengthL;
+                    UDEV_CTRL |= bUD_GP_BIT;
+                    USB_EP0_tx();
+#else
                     for (uint8_t i = 0; i < USB_EP1_SIZE; i++) {
-                        EP0_buffer[i] = EP1I_buffer[i];
+                        EP0_buffer[i] = EP1I_report[i];
                     }
                     UEP0_T_LEN = USB_EP1_SIZE;
+#endif
                     return;
 #ifdef CONSUMER_KEYS_ENABLE
                 case ITF_NUM_CONSUMER:
@@ -469,7 +592,11 @@ inline static void USB_EP0_SETUP() {
             if (setupPacket->bRequestType == (USB_REQ_TYP_OUT | USB_REQ_TYP_CLASS | USB_REQ_RECIP_INTERF)) {
                 switch (setupPacket->wIndexL) {
                 case ITF_NUM_KEYBOARD:
+#ifdef NKRO_ENABLE
+                    USB_EP1I_set_protocol(setupPacket->wValueL);
+#else
                     hid_protocol_keyboard = setupPacket->wValueL;
+#endif
                     return;
 #ifdef MOUSE_KEYS_ENABLE
                 case ITF_NUM_MOUSE:
@@ -500,30 +627,83 @@ inline static void USB_EP0_IN() {
 inline static void USB_EP0_OUT() {}
 
 uint8_t USB_EP1I_read(uint8_t idx) {
-    IE_USB = 0;
-    uint8_t value = EP1I_buffer[idx];
-    IE_USB = 1;
-    return value;
+    return EP1I_report[idx];
 }
 
 void USB_EP1I_write(uint8_t idx, uint8_t value) {
-    IE_USB = 0;
-    EP1I_buffer[idx] = value;
-    IE_USB = 1;
+    EP1I_report[idx] = value;
     USB_EP1I_ready_send();
 }
 
-inline void USB_EP1I_ready_send() {
-    UEP1_CTRL = UEP1_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_ACK;
+static void EP1I_copy_report(__xdata uint8_t *dst) {
+    for (uint8_t i = 0; i < USB_EP1_SIZE; i++) {
+        dst[i] = EP1I_report[i];
+    }
 }
 
-inline void USB_EP1I_send_now() {
+// Schedules the current report to be sent. Until USB_EP1I_send_now() seals it,
+// later changes are merged into the same report as long as the host hasn't taken it yet.
+void USB_EP1I_ready_send() {
+    IE_USB = 0;
+
+    if (EP1I_tail_open && EP1I_fifo.size) {
+        EP1I_copy_report(EP1I_fifo.q[(EP1I_fifo.head + EP1I_fifo.size - 1) & (USB_EP1I_FIFO_LEN - 1)]);
+    } else if (EP1I_tail_open && EP1I_busy) {
+        // Not taken by the host yet, so it can still be updated in place
+        EP1I_copy_report(EP1I_buffer);
+    } else {
+#ifdef USB_SOF_SYNC_ENABLE
+        uint16_t ticks = get_frame_ticks();
+        usb_sof_stats.reports++;
+        if (ticks > usb_sof_stats.report_ticks_max) usb_sof_stats.report_ticks_max = ticks;
+#endif
+
+        if (!EP1I_busy) {
+            EP1I_copy_report(EP1I_buffer);
+            EP1I_busy = 1;
+            UEP1_CTRL = UEP1_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_ACK;
+            goto done;
+        }
+
+        // Only ever waits if the host falls USB_EP1I_FIFO_LEN reports behind
+        IE_USB = 1;
+        while (EP1I_fifo.size == USB_EP1I_FIFO_LEN);
+        IE_USB = 0;
+
+        EP1I_copy_report(EP1I_fifo.q[(EP1I_fifo.head + EP1I_fifo.size) & (USB_EP1I_FIFO_LEN - 1)]);
+        EP1I_fifo.size++;
+    }
+
+done:
+    EP1I_tail_open = 1;
+    IE_USB = 1;
+}
+
+// Makes sure the host sees the current report as its own, even if it changes again right away.
+// Doesn't wait for the host.
+void USB_EP1I_send_now() {
     USB_EP1I_ready_send();
-    while (!(UEP1_CTRL & UEP_T_RES_NAK));
+    EP1I_tail_open = 0;
+}
+
+// Reports that can still be sent without waiting for the host
+uint8_t USB_EP1I_free_slots() {
+    return EP1I_busy ? USB_EP1I_FIFO_LEN - EP1I_fifo.size : USB_EP1I_FIFO_LEN + 1;
 }
 
 inline static void USB_EP1_IN() {
-    UEP1_CTRL = UEP1_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_NAK;
+    if (EP1I_fifo.size) {
+        for (uint8_t i = 0; i < USB_EP1_SIZE; i++) {
+            EP1I_buffer[i] = EP1I_fifo.q[EP1I_fifo.head][i];
+        }
+
+        EP1I_fifo.head = (EP1I_fifo.head + 1) & (USB_EP1I_FIFO_LEN - 1);
+        EP1I_fifo.size--;
+    } else {
+        UEP1_CTRL = UEP1_CTRL & ~MASK_UEP_T_RES | UEP_T_RES_NAK;
+        EP1I_busy = 0;
+        EP1I_tail_open = 0;
+    }
 }
 
 #ifdef CONSUMER_KEYS_ENABLE
@@ -570,9 +750,51 @@ inline static void USB_EP3_IN() {
 }
 #endif
 
+#ifdef USB_SOF_SYNC_ENABLE
+// Delays the scan so that it ends just before the next SOF, with the report armed for the
+// first poll of the frame. Never waits more than a frame and gives up if the scan is too long.
+void USB_SOF_wait_scan_slot() {
+    uint16_t ticks = usb_sof_stats.scan_ticks + SOF_SCAN_MARGIN_TICKS;
+
+    if (ticks < TIMER0_TICKS_PER_MS) {
+        uint16_t slot = TIMER0_TICKS_PER_MS - ticks;
+
+        if (get_frame_ticks() > slot) {
+            usb_sof_stats.late_scans++;
+        } else {
+            while (get_frame_ticks() < slot);
+        }
+    }
+
+    usb_sof_stats.scan_start_ticks = get_frame_ticks();
+}
+
+void USB_SOF_scan_done() {
+    uint16_t ticks = get_frame_ticks() - usb_sof_stats.scan_start_ticks;
+
+    // An SOF came in during the scan
+    if (ticks & 0x8000) ticks += TIMER0_TICKS_PER_MS;
+
+    // Follow increases immediately and decay slowly, so a rare long scan is not undercut
+    if (ticks > usb_sof_stats.scan_ticks) {
+        usb_sof_stats.scan_ticks = ticks;
+    } else {
+        usb_sof_stats.scan_ticks -= (usb_sof_stats.scan_ticks - ticks) >> 4;
+    }
+}
+#endif
+
 inline void USB_reset() {
     usb_tx_len = 0;
+    EP1I_fifo.head = 0;
+    EP1I_fifo.size = 0;
+    EP1I_busy = 0;
+    EP1I_tail_open = 0;
+#ifdef NKRO_ENABLE
+    USB_EP1I_set_protocol(1);
+#else
     hid_protocol_keyboard = 1;
+#endif
 #ifdef MOUSE_KEYS_ENABLE
     hid_protocol_mouse = 1;
 #endif
@@ -582,6 +804,17 @@ inline void USB_reset() {
 #pragma nooverlay
 void USB_interrupt() {
     if (UIF_TRANSFER) {
+#ifdef USB_SOF_SYNC_ENABLE
+        // Must not touch UEP0_T_LEN, as an EP0 data stage may be in progress
+        if ((USB_INT_ST & MASK_UIS_TOKEN) == UIS_TOKEN_SOF) {
+            timer_sync_to_sof();
+            usb_sof_stats.frames++;
+            UIF_TRANSFER = 0;
+            // Any other pending flag raises the interrupt again
+            return;
+        }
+#endif
+
         UEP0_T_LEN = 0;
         uint8_t endp = USB_INT_ST & MASK_UIS_ENDP;
 
@@ -636,10 +869,15 @@ void USB_init() {
     USB_CTRL &= ~bUC_CLR_ALL;
 
     // Flush endpoints
+    for (uint8_t i = USB_EP1_SIZE; i;) {
+        i--;
+        EP1I_buffer[i] = 0;
+        EP1I_report[i] = 0;
+    }
+
     for (uint8_t i = 8; i;) {
         i--;
         EP0_buffer[i] = 0;
-        EP1I_buffer[i] = 0;
 #ifdef CONSUMER_KEYS_ENABLE
         EP2I_buffer[i / 2] = 0;
 #endif
@@ -696,5 +934,8 @@ void USB_init() {
 #endif
 
     USB_INT_EN = bUIE_TRANSFER | bUIE_SUSPEND | bUIE_BUS_RST;
+#ifdef USB_SOF_SYNC_ENABLE
+    USB_INT_EN |= bUIE_DEV_SOF;
+#endif
     IE_USB = 1;
 }
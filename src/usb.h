@@ -3,10 +3,19 @@
 
 #include <stdint.h>
 
+#define USB_EP1I_BOOT_REPORT_SIZE 8
+
+#ifdef NKRO_ENABLE
+// 1 = Report protocol. The keyboard report is a bitmap with a bit per usage after the modifiers.
+// 0 = Boot protocol. The keyboard report is the regular 6KRO one.
+extern __bit hid_protocol_keyboard;
+#endif
+
 uint8_t USB_EP1I_read(uint8_t idx);
 void USB_EP1I_write(uint8_t idx, uint8_t value);
-inline void USB_EP1I_ready_send();
-inline void USB_EP1I_send_now();
+void USB_EP1I_ready_send();
+void USB_EP1I_send_now();
+uint8_t USB_EP1I_free_slots();
 
 #ifdef CONSUMER_KEYS_ENABLE
 void USB_EP2I_write_now(uint8_t idx, uint16_t value);
@@ -19,6 +28,11 @@ inline void USB_EP3I_ready_send();
 inline void USB_EP3I_send_now();
 #endif
 
+#ifdef USB_SOF_SYNC_ENABLE
+void USB_SOF_wait_scan_slot();
+void USB_SOF_scan_done();
+#endif
+
 void USB_interrupt();
 void USB_init();
 